@@ -73,6 +73,7 @@ run_test () {
   # -p                                 specifies to send each request file's requests in parallel (default is sequential)
   # -e expected                        path to file with expected result
   # -f file                            path to database file
+  # -a opt1,opt2                       extra options passed to the server
 
   local num_nodes=0
   local queryfilelist=()
@@ -80,10 +81,11 @@ run_test () {
   local parallel=0
   local expected=""
   local DB_FILE=""
+  local server_args=""
 
   local args=`cat $test_file`
 
-  options=`getopt n:t:pe:f: $args`
+  options=`getopt n:t:pe:f:a: $args`
   errcode=$?
   if [ ${errcode} -ne 0 ]; then 
     echo "illegal test configuration; aborting"
@@ -108,6 +110,7 @@ run_test () {
       -p) parallel=1; shift;;
       -e) expected=$EXPECTEDDIR/$2; shift; shift;;
       -f) DB_FILE=$2; shift; shift;;
+      -a) server_args=${2//,/ }; shift; shift;;
       --)
         shift; break;;
     esac
@@ -123,7 +126,7 @@ run_test () {
   local STARTING_PORT=3030
   local server_out=$OUTPUTDIR/server_out
 
-  ./$PROGRAM_NAME $num_nodes $STARTING_PORT $DB_FILE > $server_out 2>&1 &
+  ./$PROGRAM_NAME $num_nodes $STARTING_PORT $DB_FILE $server_args > $server_out 2>&1 &
   local server_pid=$!
 
   # Get list of ports assigned to each node
@@ -211,7 +214,7 @@ run_test () {
     printf "${GREEN}passed!${NONE}\n"
   else 
     # If test doesn't pass, print out what was run
-    printf "  - %s\n" "${BOLD}What is being run${NONE}:  ./${PROGRAM_NAME} ${num_nodes} ${STARTING_PORT} ${DB_FILE}"
+    printf "  - %s\n" "${BOLD}What is being run${NONE}:  ./${PROGRAM_NAME} ${num_nodes} ${STARTING_PORT} ${DB_FILE} ${server_args}"
     printf "  - %s\n" "${BOLD}View stdout/stderr${NONE}: ${server_out}"
   fi 
 
@@ -270,11 +273,18 @@ if [ "${test}" != "" ]; then
   ALL_TESTS=${test}
 else 
   SINGLE_TESTS="single_node_1 single_node_2 single_node_3 single_node_4"
-  MULTI_TESTS="multi_node_1 multi_node_2 multi_node_3 multi_node_4"
+  MULTI_TESTS="multi_node_1 multi_node_2 multi_node_3 multi_node_4 balanced_1"
   PARALLEL_TESTS="parallel_1 parallel_2 parallel_3"
-  ALL_TESTS="${SINGLE_TESTS} ${MULTI_TESTS} ${PARALLEL_TESTS}"
+  QUERY_TESTS="multi_term_1 boolean_1"
+  FORMAT_TESTS="compressed_1 compressed_2 mmap_1 mmap_2"
+  INDEX_TESTS="mph_1 mph_2"
+  REPLICA_TESTS="replica_1 replica_2"
+  PRERENDER_TESTS="prerender_1 prerender_2 prerender_3"
+  ALL_TESTS="${SINGLE_TESTS} ${MULTI_TESTS} ${PARALLEL_TESTS} ${QUERY_TESTS} ${FORMAT_TESTS} ${INDEX_TESTS} ${REPLICA_TESTS} ${PRERENDER_TESTS}"
 fi
 
+INDEXED_DBS="tests/files/large_sorted tests/files/extra_large_compressed"
+
 # Timeout
 TIMEOUT=$(which timeout)
 if [ "$?" = "0" ]; then
@@ -285,6 +295,12 @@ else
 fi
 
 run_make $verbose
+# Tests on these databases use a prebuilt index, the others build their hash
+# tables at startup.
+for db in ${INDEXED_DBS}; do
+  rm -f ${db}.idx
+  ./db_tool index ${db} > /dev/null 2>&1
+done
 # Just run this once instead of a bunch of times for each file
 rm -rf ${OUTPUTDIR}
 mkdir -p ${OUTPUTDIR}
@@ -0,0 +1,84 @@
+#include "csapp/csapp.h"
+#include "bloom.h"
+
+/** @brief Sets or tests the bits of a key.
+ *  @param set whether to set the bits rather than test them
+ *  @return 1 if all the bits were set before the call, 0 otherwise.
+ */
+static int bloom_bits(const bloom *b, const char *key, int set) {
+  uint64_t h = hash_key(key, strlen(key));
+  uint32_t h1 = (uint32_t) h, h2 = (uint32_t) (h >> 32) | 1;
+  int all = 1;
+
+  for (uint32_t i = 0; i < b->nhashes; i++) {
+    uint32_t bit = (h1 + i * h2) % b->nbits;
+    if (!(b->bits[bit / 8] & (1 << (bit % 8))))
+      all = 0;
+    if (set)
+      b->bits[bit / 8] |= 1 << (bit % 8);
+  }
+  return all;
+}
+
+/** @brief Builds a Bloom filter of all the keys of a partition. */
+bloom *bloom_build(database *db) {
+  bloom *b = Malloc(sizeof(bloom));
+  uint32_t n = 0;
+  char *entry;
+
+  for (entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry))
+    n++;
+  b->nbits = (n ? n : 1) * BLOOM_BITS_PER_KEY;
+  b->nhashes = BLOOM_HASHES;
+  b->bits = Calloc((b->nbits + 7) / 8, 1);
+  for (entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry))
+    bloom_bits(b, entry, 1);
+  return b;
+}
+
+/** @brief Returns 0 if the key is certainly not in the filter's partition, or
+ *         1 if it may be.
+ */
+int bloom_may_contain(const bloom *b, const char *key) {
+  return bloom_bits(b, key, 0);
+}
+
+/** @brief Packs a filter to be sent to another node.
+ *  @return the packed filter, which the caller must free.
+ */
+char *bloom_pack(const bloom *b, uint32_t *len) {
+  uint32_t nbytes = (b->nbits + 7) / 8, n;
+  char *buf = Malloc(BLOOM_PACK_HDR + nbytes);
+
+  n = htonl(b->nbits);
+  memcpy(buf, &n, sizeof(n));
+  n = htonl(b->nhashes);
+  memcpy(buf + sizeof(n), &n, sizeof(n));
+  memcpy(buf + BLOOM_PACK_HDR, b->bits, nbytes);
+  *len = BLOOM_PACK_HDR + nbytes;
+  return buf;
+}
+
+/** @brief Unpacks a filter packed by bloom_pack.
+ *  @return the filter, or NULL if the payload is malformed.
+ */
+bloom *bloom_unpack(const char *buf, uint32_t len) {
+  uint32_t nbits, nhashes;
+  bloom *b;
+
+  if (len < BLOOM_PACK_HDR)
+    return NULL;
+  memcpy(&nbits, buf, sizeof(nbits));
+  memcpy(&nhashes, buf + sizeof(nbits), sizeof(nhashes));
+  nbits = ntohl(nbits);
+  nhashes = ntohl(nhashes);
+  if (nbits == 0 || len - BLOOM_PACK_HDR != (nbits + 7) / 8
+      || nhashes == 0 || nhashes > BLOOM_MAX_HASHES)
+    return NULL;
+  b = Malloc(sizeof(bloom));
+  b->nbits = nbits;
+  b->nhashes = nhashes;
+  b->bits = Malloc(len - BLOOM_PACK_HDR);
+  memcpy(b->bits, buf + BLOOM_PACK_HDR, len - BLOOM_PACK_HDR);
+  return b;
+}
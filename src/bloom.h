@@ -0,0 +1,33 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+#include "utils.h"
+#include <stdint.h>
+
+/* A Bloom filter of the keys of a partition. Every node builds one for each
+ * partition it holds, and other nodes fetch it with PEER_FILTER so that they
+ * can answer lookups of keys the partition does not hold without asking its
+ * replicas. A filter never misses a key it was built from; it wrongly claims
+ * to hold about 1% of the other keys, which are then forwarded as usual.
+ *
+ * The k bit positions of a key come from its hash_key by double hashing. The
+ * packed form is nbits and nhashes in network byte order followed by the
+ * bits. */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+// Most hash functions a fetched filter may use
+#define BLOOM_MAX_HASHES 32
+#define BLOOM_PACK_HDR 8
+
+typedef struct bloom {
+  uint32_t nbits;
+  uint32_t nhashes;
+  uint8_t *bits;
+} bloom;
+
+bloom *bloom_build(database *db);
+int bloom_may_contain(const bloom *b, const char *key);
+char *bloom_pack(const bloom *b, uint32_t *len);
+bloom *bloom_unpack(const char *buf, uint32_t len);
+
+#endif /* __BLOOM_H__ */
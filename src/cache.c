@@ -4,91 +4,319 @@
 #include "cache.h"
 #include "utils.h"
 
+#define CHUNK_SIZE(class) ((size_t) 1 << ((class) + CACHE_MIN_CLASS))
+
+/**
+ * Init the cache, splitting a budget of max_bytes evenly between the shards.
+ * Values larger than max_object bytes are never cached.
+*/
+void init_cache(Cache* cache, size_t max_bytes, size_t max_object) {
+    memset(cache, 0, sizeof(Cache));
+    cache->max_object = max_object;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->budget = max_bytes / CACHE_SHARDS;
+        shard->nbuckets = 64;
+        shard->buckets = Calloc(shard->nbuckets, sizeof(CacheNode*));
+    }
+}
+
 /**
- * Init the cache
+ * Returns the shard the key with the given hash belongs to. The bucket within
+ * the shard comes from the low bits of the hash, so the shard is picked with
+ * the high ones.
 */
-void init_cache(Cache* cache, int cache_num) {
-    cache->cache_num = cache_num;
-    cache->array = calloc(cache_num, sizeof(CacheNode));
-    cache->time_index = 0;
-    cache->size = 0;
+static CacheShard* get_shard(Cache* cache, uint64_t hash) {
+    return &cache->shards[(hash >> 32) % CACHE_SHARDS];
 }
 
 /**
- * Reader. Look up the index of the key in cache.
- * @return The index of the data requested, or -1 if not found
+ * Returns the counter of the key with the given hash in a row of the sketch.
+ * The rows are indexed by double hashing.
 */
-char* lookup_cache(Cache* cache, char* key, sem_t* mutex, sem_t* w, int* readcnt) {
-    P(mutex);
-    (*readcnt)++;
-    if (*readcnt == 1) /* First in */
-        P(w);
-    V(mutex);
+static uint8_t* sketch_counter(CacheShard* shard, uint64_t hash, int row) {
+    uint32_t i = (uint32_t) hash + row * ((uint32_t) (hash >> 32) | 1);
+    return &shard->sketch[row][i & (CACHE_SKETCH_WIDTH - 1)];
+}
 
-    int i;
-    char* result = NULL;
-    int index = -1;
-    for(i = 0; i < cache->size; i++) {
-        if (strcmp(cache->array[i].key, key) == 0) {
-            index = i;
-            break;
+/**
+ * Counts a lookup of the key in the sketch. Called with the shard locked for
+ * reading, so other readers may be counting too.
+*/
+static void sketch_increment(CacheShard* shard, uint64_t hash) {
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t* counter = sketch_counter(shard, hash, row);
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < CACHE_SKETCH_MAX)
+            __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&shard->lookups, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Estimates how often the key was looked up recently. The caller must hold
+ * the write lock of the shard.
+*/
+static int sketch_estimate(CacheShard* shard, uint64_t hash) {
+    int min = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        int count = *sketch_counter(shard, hash, row);
+        if (count < min)
+            min = count;
+    }
+    return min;
+}
+
+/**
+ * Halves every counter of the sketch once enough lookups have been counted, so
+ * that keys that used to be popular do not keep their counts forever. The
+ * caller must hold the write lock of the shard.
+*/
+static void sketch_age(CacheShard* shard) {
+    if (shard->lookups < CACHE_SKETCH_SAMPLE)
+        return;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++)
+        for (int i = 0; i < CACHE_SKETCH_WIDTH; i++)
+            shard->sketch[row][i] >>= 1;
+    shard->lookups = 0;
+}
+
+/**
+ * Returns the entry of the key in the shard, or NULL if it is not cached. The
+ * caller must hold the lock of the shard.
+*/
+static CacheNode* find_cached(CacheShard* shard, char* key, uint64_t hash) {
+    CacheNode* node = shard->buckets[hash & (shard->nbuckets - 1)];
+    for (; node != NULL; node = node->next) {
+        if (node->hash == hash && strcmp(node->key, key) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+/**
+ * Doubles the number of buckets of the hash index of the shard. The caller
+ * must hold the write lock of the shard.
+*/
+static void grow_index(CacheShard* shard) {
+    int nbuckets = shard->nbuckets * 2;
+    CacheNode** buckets = Calloc(nbuckets, sizeof(CacheNode*));
+
+    for (int i = 0; i < shard->nbuckets; i++) {
+        CacheNode* node = shard->buckets[i];
+        while (node != NULL) {
+            CacheNode* next = node->next;
+            node->next = buckets[node->hash & (nbuckets - 1)];
+            buckets[node->hash & (nbuckets - 1)] = node;
+            node = next;
         }
     }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
 
-    if (index != -1) 
-        result = strdup(cache->array[index].value);
-    
+/**
+ * Puts the chunk of an entry that is neither cached nor referenced any more
+ * on the free list of its class. The caller must hold the write lock of the
+ * shard.
+*/
+static void free_chunk(CacheShard* shard, CacheNode* node) {
+    node->next = shard->free_chunks[node->chunk_class];
+    shard->free_chunks[node->chunk_class] = node;
+}
 
-    P(mutex);
-    (*readcnt)--;
-    if (index != -1)
-        cache->array[index].used += 1;
-    if (*readcnt == 0) /* Last out */
-        V(w);
-    V(mutex);
+/**
+ * Gives one free chunk, of any class, back to the allocator.
+ * @return 1 if there was one, 0 if all the free lists are empty.
+*/
+static int release_free_chunk(CacheShard* shard) {
+    for (int class = 0; class < CACHE_CLASSES; class++) {
+        CacheNode* node = shard->free_chunks[class];
+        if (node != NULL) {
+            shard->free_chunks[class] = node->next;
+            shard->bytes -= CHUNK_SIZE(class);
+            free(node);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    return result;
+/**
+ * Removes an entry from the shard and drops the reference the cache held on
+ * it. Its chunk is freed once nobody else references it. The caller must hold
+ * the write lock of the shard.
+*/
+static void evict(CacheShard* shard, CacheNode* node) {
+    CacheNode** link = &shard->buckets[node->hash & (shard->nbuckets - 1)];
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+
+    if (node->clock_next == node) {
+        shard->hand = NULL;
+    } else {
+        if (shard->hand == node)
+            shard->hand = node->clock_next;
+        node->clock_prev->clock_next = node->clock_next;
+        node->clock_next->clock_prev = node->clock_prev;
+    }
+    shard->count--;
+
+    if (__atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        free_chunk(shard, node);
 }
 
 /**
- * Update the time index
+ * Advances the clock hand of the shard to the first entry that has not been
+ * used since the hand last went past it, clearing the used bits on the way.
+ * @return that entry, or NULL if the shard is empty.
 */
-void update_time_index(Cache* cache) {
-    int time_index = cache->time_index;
-    if (time_index == cache->cache_num - 1)
-        time_index = 0;
-    else 
-        time_index++;
+static CacheNode* clock_victim(CacheShard* shard) {
+    if (shard->hand == NULL)
+        return NULL;
+    while (shard->hand->used) {
+        shard->hand->used = 0;
+        shard->hand = shard->hand->clock_next;
+    }
+    return shard->hand;
 }
 
 /**
- * Writer, write the key and value to cache. Remove one cache when it is full.
+ * Finds a chunk of the given class for a new entry whose key has been looked
+ * up about freq times. Free chunks of the class are reused first. Otherwise,
+ * while the shard is over budget, free chunks of other classes are given back
+ * and then entries are evicted, as long as each victim is less popular than
+ * the new key. The caller must hold the write lock of the shard.
+ * @return the chunk, or NULL if the new entry should not be cached.
 */
-void write_cache(Cache* cache, char* key, char* value, sem_t* mutex, sem_t* w) {
-    P(w);
+static CacheNode* alloc_chunk(CacheShard* shard, int class, int freq) {
+    CacheNode* node;
+
+    while (shard->free_chunks[class] == NULL
+           && shard->bytes + CHUNK_SIZE(class) > shard->budget) {
+        if (release_free_chunk(shard))
+            continue;
+        if ((node = clock_victim(shard)) == NULL)
+            return NULL;
+        if (sketch_estimate(shard, node->hash) >= freq)
+            return NULL;
+        evict(shard, node);
+    }
+    if ((node = shard->free_chunks[class]) != NULL) {
+        shard->free_chunks[class] = node->next;
+        return node;
+    }
+    shard->bytes += CHUNK_SIZE(class);
+    return Malloc(CHUNK_SIZE(class));
+}
 
-    int index;
-    // if the array is full
+/**
+ * Reader. Look up the key in cache. Only the shard of the key is locked, and
+ * only for reading.
+ * @return The entry of the key, with a reference held that the caller must
+ * drop with release_cache, or NULL if not found.
+*/
+CacheNode* lookup_cache(Cache* cache, char* key) {
+    uint64_t hash = hash_key(key, strlen(key));
+    CacheShard* shard = get_shard(cache, hash);
 
-    if (cache->size == cache->cache_num) {
-        while (cache->array[cache->time_index].used != 0) {
-            cache->array[cache->time_index].used = 0;
-            update_time_index(cache);
-        }
-        cache->array[cache->time_index].used = 1;
-        free(cache->array[cache->time_index].value);
-        free(cache->array[cache->time_index].key);
-        index = cache->time_index;
-        update_time_index(cache);
+    pthread_rwlock_rdlock(&shard->lock);
+    sketch_increment(shard, hash);
+    CacheNode* node = find_cached(shard, key, hash);
+    if (node != NULL) {
+        __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+        // other readers may be marking it too
+        __atomic_store_n(&node->used, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
     } else {
-        index = cache->size;
-        cache->size++;
+        __atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return node;
+}
+
+/**
+ * Drops a reference returned by lookup_cache. Only the last reference to an
+ * entry that has been evicted needs the lock of its shard.
+*/
+void release_cache(CacheNode* node) {
+    if (__atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        CacheShard* shard = node->shard;
+        pthread_rwlock_wrlock(&shard->lock);
+        free_chunk(shard, node);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/**
+ * Writer, write a copy of the key and value to cache, if the key is popular
+ * enough to be admitted. If the key is already cached its entry is replaced,
+ * without disturbing readers of the old one.
+*/
+void write_cache(Cache* cache, char* key, void* value, size_t size) {
+    uint64_t hash = hash_key(key, strlen(key));
+    CacheShard* shard = get_shard(cache, hash);
+    size_t key_len = strlen(key) + 1;
+    size_t total = sizeof(CacheNode) + size + key_len;
+    CacheNode* node;
+    int class = 0;
+
+    while (CHUNK_SIZE(class) < total)
+        class++;
+    if (size > cache->max_object || CHUNK_SIZE(class) > shard->budget)
+        return;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    sketch_age(shard);
+    int freq = sketch_estimate(shard, hash);
+    if ((node = find_cached(shard, key, hash)) != NULL) {
+        evict(shard, node);
+        // it was cached already, so it needs no admission
+        freq = CACHE_SKETCH_MAX + 1;
     }
 
-    cache->array[index].used = 1;
-    cache->array[index].key = strdup(key);
-    cache->array[index].value = strdup(value);
+    if ((node = alloc_chunk(shard, class, freq)) != NULL) {
+        node->value = (char*) node + sizeof(CacheNode);
+        node->key = (char*) node->value + size;
+        memcpy(node->value, value, size);
+        memcpy(node->key, key, key_len);
+        node->size = size;
+        node->hash = hash;
+        node->used = 1;
+        node->refcount = 1;
+        node->chunk_class = class;
+        node->shard = shard;
 
+        if (shard->count >= shard->nbuckets)
+            grow_index(shard);
+        node->next = shard->buckets[hash & (shard->nbuckets - 1)];
+        shard->buckets[hash & (shard->nbuckets - 1)] = node;
+        // new entries go just behind the hand, the last place it will visit
+        if (shard->hand == NULL) {
+            node->clock_prev = node->clock_next = node;
+            shard->hand = node;
+        } else {
+            node->clock_next = shard->hand;
+            node->clock_prev = shard->hand->clock_prev;
+            node->clock_prev->clock_next = node;
+            shard->hand->clock_prev = node;
+        }
+        shard->count++;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+}
 
-    V(w);
-}   
\ No newline at end of file
+/**
+ * Sums the hits and misses of lookup_cache over all the shards
+*/
+void cache_stats(Cache* cache, long* hits, long* misses) {
+    *hits = *misses = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        *hits += __atomic_load_n(&cache->shards[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&cache->shards[i].misses, __ATOMIC_RELAXED);
+    }
+}
@@ -1,19 +1,81 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp/csapp.h"
+#include <stdint.h>
+
+/* The cache is split into CACHE_SHARDS shards by the hash of the key. Each
+ * shard has its own lock, a hash index of its entries and its own clock hand,
+ * so lookups of keys in different shards never wait for each other and a
+ * writer only blocks the readers of one shard.
+ *
+ * Every shard holds at most its share of the byte budget given to init_cache,
+ * counting whole entries. An entry is a single chunk holding the CacheNode,
+ * the value and the key. Chunks come in power of two size classes and freed
+ * ones are kept on per-class free lists for reuse, so their bytes still count
+ * against the budget until they are given back to make room for another
+ * class.
+ *
+ * A new key only goes in if it has been asked for more often than the entries
+ * it would evict (TinyLFU). The frequencies are estimated with a count-min
+ * sketch per shard, whose byte counters saturate at CACHE_SKETCH_MAX. It
+ * counts every lookup, hit or miss, and is halved every CACHE_SKETCH_SAMPLE
+ * lookups so that it follows changes in popularity. A burst of one-off keys
+ * then cannot flush the hot ones. */
+#define CACHE_SHARDS 16
+// Counters in each of the CACHE_SKETCH_ROWS rows of the sketch of a shard
+#define CACHE_SKETCH_WIDTH 1024
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_MAX 15
+#define CACHE_SKETCH_SAMPLE (10 * CACHE_SKETCH_WIDTH)
+// Size of the smallest chunk class, as a power of two
+#define CACHE_MIN_CLASS 6
+#define CACHE_CLASSES 26
+
+typedef struct CacheShard CacheShard;
 
+/* An entry of the cache. Lookups return it with a reference held, and value
+ * stays valid until the reference is dropped with release_cache, even if the
+ * entry is evicted in the meantime. */
 typedef struct CacheNode {
     char* key;
-    char* value;
+    void* value;
+    size_t size;
+    uint64_t hash;
     int used;
+    int refcount;                // references held, plus one while cached
+    int chunk_class;
+    CacheShard* shard;
+    struct CacheNode* next;      // next entry in the same hash bucket, or in
+                                 // the same free list
+    struct CacheNode* clock_prev; // neighbours on the clock ring
+    struct CacheNode* clock_next;
 } CacheNode;
 
+struct CacheShard {
+    pthread_rwlock_t lock;
+    CacheNode** buckets;   // hash index of the cached entries
+    int nbuckets;          // a power of two
+    int count;
+    CacheNode* hand;       // clock hand, NULL while the shard is empty
+    CacheNode* free_chunks[CACHE_CLASSES];
+    size_t bytes;          // bytes of all chunks, cached, pinned or free
+    size_t budget;
+    uint8_t sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+    int lookups;           // since the sketch was last halved
+    long hits;
+    long misses;
+};
+
 typedef struct Cache {
-    CacheNode* array;
-    int cache_num;
-    int time_index;
-    int size;
+    CacheShard shards[CACHE_SHARDS];
+    size_t max_object;
 } Cache;
 
-void init_cache(Cache* cache, int cache_num);
-char* lookup_cache(Cache* cache, char* key, sem_t* mutex, sem_t* w, int* readcnt);
-void update_time_index(Cache* cache);
-void write_cache(Cache* cache, char* key, char* value, sem_t* mutex, sem_t* w);
\ No newline at end of file
+void init_cache(Cache* cache, size_t max_bytes, size_t max_object);
+CacheNode* lookup_cache(Cache* cache, char* key);
+void release_cache(CacheNode* node);
+void write_cache(Cache* cache, char* key, void* value, size_t size);
+void cache_stats(Cache* cache, long* hits, long* misses);
+
+#endif /* __CACHE_H__ */
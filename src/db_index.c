@@ -0,0 +1,327 @@
+#include "csapp/csapp.h"
+#include "db_index.h"
+
+/** @brief 64-bit FNV-1a style hash of a buffer, continuing from h. */
+static uint64_t mix_bytes(uint64_t h, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 1099511628211ull;
+  return h;
+}
+
+/** @brief Checksum of a slot array, hashed a whole slot at a time. */
+static uint64_t slots_checksum(const db_index_slot *slots, uint32_t nslots) {
+  uint64_t h = 14695981039346656037ull, w;
+  for (uint32_t i = 0; i < nslots; i++) {
+    w = ((uint64_t) slots[i].hash << 32) | slots[i].offset;
+    h = (h ^ w) * 1099511628211ull;
+  }
+  return h;
+}
+
+/** @brief Computes a cheap fingerprint of the database file open as fd, from
+ *         its size and its first and last DB_INDEX_SAMPLE bytes. Together with
+ *         the modification time of the file it is used to notice that an index
+ *         was built for a different version of the database without reading
+ *         the whole file.
+ *
+ *  @param size set to the size of the file
+ *  @param mtime set to the modification time of the file
+ *  @return 0 on success, -1 if the file could not be read.
+ */
+static int db_fingerprint(int fd, uint64_t *size, int64_t *mtime, uint64_t *fingerprint) {
+  char buf[DB_INDEX_SAMPLE];
+  struct stat info;
+  size_t n;
+  uint64_t h = 14695981039346656037ull;
+
+  if (fstat(fd, &info) < 0)
+    return -1;
+  *size = info.st_size;
+  *mtime = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  h = mix_bytes(h, size, sizeof(*size));
+  n = MIN((size_t) info.st_size, DB_INDEX_SAMPLE);
+  if (pread(fd, buf, n, 0) != (ssize_t) n)
+    return -1;
+  h = mix_bytes(h, buf, n);
+  if (pread(fd, buf, n, info.st_size - n) != (ssize_t) n)
+    return -1;
+  *fingerprint = mix_bytes(h, buf, n);
+  return 0;
+}
+
+/** @brief Cuts the n entries of a database into segments, each of at least
+ *         DB_INDEX_SEGMENT_KEYS entries but the last, and sets the start,
+ *         smallest key and slots of every segment.
+ *
+ *  @param bounds set to the index in entries of the first entry of every
+ *         segment, followed by n
+ *  @return the number of segments.
+ */
+static uint32_t cut_segments(database *db, char **entries, size_t n, db_index_segment *segs,
+                             size_t *bounds) {
+  char **prefix_max = Malloc((n + 1) * sizeof(char *));
+  char **suffix_min = Malloc((n + 1) * sizeof(char *));
+  size_t i, first = 0;
+  uint64_t nslots = 0;
+  uint32_t nsegs = 0;
+
+  // a cut before entry i is valid if prefix_max[i] < suffix_min[i], as in
+  // plan_partitions
+  prefix_max[0] = NULL;
+  for (i = 0; i < n; i++)
+    prefix_max[i + 1] = (prefix_max[i] && strcmp(prefix_max[i], entries[i]) > 0) ? prefix_max[i] : entries[i];
+  suffix_min[n] = NULL;
+  for (i = n; i > 0; i--)
+    suffix_min[i - 1] = (suffix_min[i] && strcmp(suffix_min[i], entries[i - 1]) < 0) ? suffix_min[i] : entries[i - 1];
+
+  for (i = 1; i <= n; i++) {
+    if (i < n && (i - first < DB_INDEX_SEGMENT_KEYS || strcmp(prefix_max[i], suffix_min[i]) >= 0))
+      continue;
+    segs[nsegs].start = entries[first] - db->map_ptr;
+    segs[nsegs].min = suffix_min[first] - db->map_ptr;
+    segs[nsegs].slot = nslots;
+    // keep the table at most half full
+    segs[nsegs].nslots = 1;
+    while (segs[nsegs].nslots < 2 * (i - first))
+      segs[nsegs].nslots <<= 1;
+    nslots += segs[nsegs].nslots;
+    bounds[nsegs++] = first;
+    first = i;
+  }
+  bounds[nsegs] = n;
+  free(prefix_max);
+  free(suffix_min);
+  return nsegs;
+}
+
+/** @brief Builds the index of a whole database and writes it to db_path
+ *         followed by DB_INDEX_SUFFIX.
+ *
+ *  @param db the database, as returned by load_database(db_path)
+ *  @param db_path path of the database file
+ *  @return the number of keys indexed, or -1 on error.
+ */
+int db_index_build(database *db, char *db_path) {
+  char idx_path[PATH_MAX];
+  db_index_header hdr;
+  db_index_segment *segs;
+  db_index_slot *slots = NULL;
+  char **entries;
+  size_t n = 0, i = 0, off, *bounds;
+  uint32_t nsegs, mask, h;
+  FILE *out;
+  int fd, rc = 0;
+
+  for (char *entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry))
+    n++;
+  entries = Malloc((n + 1) * sizeof(char *));
+  for (char *entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry))
+    entries[i++] = entry;
+  segs = Calloc(n / DB_INDEX_SEGMENT_KEYS + 1, sizeof(db_index_segment));
+  bounds = Malloc((n / DB_INDEX_SEGMENT_KEYS + 2) * sizeof(size_t));
+  nsegs = cut_segments(db, entries, n, segs, bounds);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DB_INDEX_MAGIC, DB_MAGIC_LEN);
+  hdr.version = DB_INDEX_VERSION;
+  hdr.nsegments = nsegs;
+  hdr.nslots = nsegs ? segs[nsegs - 1].slot + segs[nsegs - 1].nslots : 0;
+  hdr.nkeys = n;
+  slots = Calloc(hdr.nslots + 1, sizeof(db_index_slot));
+  for (uint32_t s = 0; s < nsegs && rc == 0; s++) {
+    mask = segs[s].nslots - 1;
+    for (i = bounds[s]; i < bounds[s + 1]; i++) {
+      off = (size_t) (entries[i] - db->map_ptr);
+      if (off % sizeof(int) != 0 || off / sizeof(int) >= UINT32_MAX) {
+        fprintf(stderr, "%s: entry at offset %zu cannot be indexed\n", db_path, off);
+        rc = -1;
+        break;
+      }
+      h = hash_key(entries[i], strlen(entries[i]));
+      for (uint32_t j = h & mask; ; j = (j + 1) & mask) {
+        if (slots[segs[s].slot + j].offset == 0) {
+          slots[segs[s].slot + j].hash = h;
+          slots[segs[s].slot + j].offset = off / sizeof(int) + 1;
+          break;
+        }
+      }
+    }
+    segs[s].checksum = slots_checksum(slots + segs[s].slot, segs[s].nslots);
+  }
+
+  snprintf(idx_path, PATH_MAX, "%s%s", db_path, DB_INDEX_SUFFIX);
+  if (rc == 0 && ((fd = open(db_path, O_RDONLY)) < 0
+                  || db_fingerprint(fd, &hdr.db_size, &hdr.db_mtime, &hdr.db_fingerprint) < 0)) {
+    fprintf(stderr, "%s: %s\n", db_path, strerror(errno));
+    rc = -1;
+  } else if (rc == 0) {
+    Close(fd);
+    if ((out = fopen(idx_path, "wb")) == NULL
+        || fwrite(&hdr, sizeof(hdr), 1, out) != 1
+        || fwrite(segs, sizeof(db_index_segment), nsegs, out) != nsegs
+        || fwrite(slots, sizeof(db_index_slot), hdr.nslots, out) != hdr.nslots
+        || fclose(out) != 0) {
+      fprintf(stderr, "%s: %s\n", idx_path, strerror(errno));
+      rc = -1;
+    }
+  }
+  free(entries);
+  free(bounds);
+  free(segs);
+  free(slots);
+  return rc < 0 ? -1 : (int) n;
+}
+
+/** @brief Maps the index of the database at db_path, if it has one, after
+ *         checking that it was built for this database. The slots are only
+ *         read, and checked with db_index_check, for the partitions that use
+ *         them.
+ *
+ *  @return the index, or NULL if there is no usable index, in which case the
+ *          caller should build a hash table instead.
+ */
+db_index *db_index_open(char *db_path) {
+  char idx_path[PATH_MAX];
+  db_index_header *hdr;
+  db_index *idx;
+  uint64_t db_size, fingerprint;
+  int64_t mtime;
+  struct stat info;
+  char *reason = NULL;
+  void *ptr;
+  int fd;
+
+  snprintf(idx_path, PATH_MAX, "%s%s", db_path, DB_INDEX_SUFFIX);
+  if ((fd = open(idx_path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(db_index_header)) {
+    Close(fd);
+    fprintf(stderr, "%s: not an index\n", idx_path);
+    return NULL;
+  }
+  ptr = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  Close(fd);
+  if (ptr == MAP_FAILED) {
+    fprintf(stderr, "%s: mmap error: %s\n", idx_path, strerror(errno));
+    return NULL;
+  }
+
+  hdr = ptr;
+  fd = open(db_path, O_RDONLY);
+  if (memcmp(hdr->magic, DB_INDEX_MAGIC, DB_MAGIC_LEN) != 0 || hdr->version != DB_INDEX_VERSION)
+    reason = "unsupported version";
+  else if (hdr->nslots > (uint64_t) info.st_size || hdr->nsegments > (uint64_t) info.st_size
+           || (size_t) info.st_size != sizeof(db_index_header)
+                                       + (size_t) hdr->nsegments * sizeof(db_index_segment)
+                                       + (size_t) hdr->nslots * sizeof(db_index_slot))
+    reason = "truncated";
+  else if (fd < 0 || db_fingerprint(fd, &db_size, &mtime, &fingerprint) < 0
+           || db_size != hdr->db_size || mtime != hdr->db_mtime
+           || fingerprint != hdr->db_fingerprint)
+    reason = "built for a different database";
+  if (fd >= 0)
+    Close(fd);
+  if (reason) {
+    fprintf(stderr, "%s: %s, ignoring it\n", idx_path, reason);
+    Munmap(ptr, info.st_size);
+    return NULL;
+  }
+
+  idx = Malloc(sizeof(db_index));
+  idx->hdr = hdr;
+  idx->segments = (db_index_segment *) (hdr + 1);
+  idx->slots = (db_index_slot *) (idx->segments + hdr->nsegments);
+  idx->map_size = info.st_size;
+  return idx;
+}
+
+/** @brief Returns the last segment of the index that starts at or before the
+ *         file offset base, or 0 if there is none.
+ */
+static uint32_t first_segment(db_index *idx, size_t base) {
+  uint32_t lo = 0, hi = idx->hdr->nsegments, mid;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (idx->segments[mid].start <= base)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/** @brief Checks the segments of the index that overlap the partition at file
+ *         offset base of size bytes, so that a node reads only the slots it
+ *         will use. The smallest key of every segment that starts in the
+ *         partition must lie in it as well, which holds when the partition
+ *         ends at a valid cut, or db_index_find could not search it.
+ *
+ *  @return 0 if they are intact, or -1 if the index must not be used for the
+ *          partition.
+ */
+int db_index_check(db_index *idx, size_t base, size_t size) {
+  uint32_t first = first_segment(idx, base);
+  db_index_segment *seg;
+  char *reason = NULL;
+
+  for (uint32_t s = first; s < idx->hdr->nsegments && reason == NULL; s++) {
+    seg = &idx->segments[s];
+    if (seg->start >= base + size)
+      break;
+    if (seg->nslots == 0 || (seg->nslots & (seg->nslots - 1)) != 0
+        || seg->slot > idx->hdr->nslots || seg->nslots > idx->hdr->nslots - seg->slot
+        || slots_checksum(idx->slots + seg->slot, seg->nslots) != seg->checksum)
+      reason = "checksum mismatch";
+    else if (s > first && seg->min >= base + size)
+      reason = "smallest key outside the partition";
+    if (reason)
+      fprintf(stderr, "index segment %u: %s, ignoring the index for the partition at "
+              "offset %zu\n", s, reason, base);
+  }
+  return reason ? -1 : 0;
+}
+
+/** @brief Looks a key up in the index of a database partition. The key can
+ *         only be in one segment: the last that starts in the partition and
+ *         holds, from its start on, a key not greater than it, or else the
+ *         one the partition starts in. Segments cover more than the
+ *         partition, so slots whose entry lies outside it are skipped.
+ *
+ *  @return A pointer to the start of the entry in the partition, or NULL if
+ *          the partition does not contain the key.
+ */
+char *db_index_find(database *db, char *key) {
+  db_index *idx = db->index;
+  uint32_t s, hi = idx->hdr->nsegments, mid, h, mask;
+  db_index_slot *slots;
+  size_t off;
+
+  if (hi == 0)
+    return NULL;
+  // every segment after the first that starts in the partition has its
+  // smallest key there too, as db_index_check made sure
+  s = first_segment(idx, db->base);
+  while (hi - s > 1) {
+    mid = s + (hi - s) / 2;
+    if (idx->segments[mid].start < db->base + db->db_size
+        && strcmp(db->m_ptr + (idx->segments[mid].min - db->base), key) <= 0)
+      s = mid;
+    else
+      hi = mid;
+  }
+
+  slots = idx->slots + idx->segments[s].slot;
+  mask = idx->segments[s].nslots - 1;
+  h = hash_key(key, strlen(key));
+  for (uint32_t i = h & mask; slots[i].offset != 0; i = (i + 1) & mask) {
+    if (slots[i].hash != h)
+      continue;
+    off = (size_t) (slots[i].offset - 1) * sizeof(int);
+    if (off < db->base || off >= db->base + db->db_size)
+      continue;
+    if (strcmp(db->m_ptr + (off - db->base), key) == 0)
+      return db->m_ptr + (off - db->base);
+  }
+  return NULL;
+}
@@ -0,0 +1,68 @@
+#ifndef __DB_INDEX_H__
+#define __DB_INDEX_H__
+
+#include "utils.h"
+#include <stdint.h>
+
+/* A prebuilt hash index of a whole database file, written by
+ * "db_tool index" to DB_INDEX_SUFFIX next to the database. A node maps it
+ * read-only and uses it in place of build_hash_table, so it does not have to
+ * hash every key of its partition at startup.
+ *
+ * The file is a db_index_header, nsegments db_index_segment entries and then
+ * the slots of every segment, in the byte order of the machine that built
+ * it. The database is cut into segments of at least DB_INDEX_SEGMENT_KEYS
+ * entries, only where every key before the cut is smaller than every key
+ * after it, the same kind of place a partition can start. Each segment is a
+ * hash table of its own entries with its own checksum, so a node only reads
+ * and checks the segments its partitions overlap.
+ *
+ * A slot holds the low 32 bits of the hash_key of a key and the offset of its
+ * entry in the database file, in units of sizeof(int), plus one so that 0
+ * marks an empty slot. Offsets rather than pointers make the index
+ * independent of where the database is mapped. */
+#define DB_INDEX_SUFFIX ".idx"
+#define DB_INDEX_MAGIC "\x7fIIDXIDX"
+#define DB_INDEX_VERSION 2
+// Bytes at each end of the database file covered by its fingerprint
+#define DB_INDEX_SAMPLE 4096
+#define DB_INDEX_SEGMENT_KEYS 512
+
+typedef struct db_index_header {
+  char magic[DB_MAGIC_LEN];
+  uint32_t version;        /* DB_INDEX_VERSION */
+  uint32_t nsegments;
+  uint64_t nslots;         /* of all segments */
+  uint64_t nkeys;
+  uint64_t db_size;        /* size of the database file the index was built for */
+  uint64_t db_fingerprint; /* see db_fingerprint */
+  int64_t db_mtime;        /* modification time of the database file, in ns */
+} db_index_header;
+
+typedef struct db_index_segment {
+  uint64_t start;    /* file offset of its first entry */
+  uint64_t min;      /* file offset of the smallest key from start on */
+  uint64_t slot;     /* index of its first slot */
+  uint32_t nslots;   /* a power of two */
+  uint32_t reserved;
+  uint64_t checksum; /* of its slots */
+} db_index_segment;
+
+typedef struct db_index_slot {
+  uint32_t hash;
+  uint32_t offset; /* in units of sizeof(int), plus one; 0 if the slot is empty */
+} db_index_slot;
+
+typedef struct db_index {
+  db_index_header *hdr;
+  db_index_segment *segments;
+  db_index_slot *slots;
+  size_t map_size;
+} db_index;
+
+int db_index_build(database *db, char *db_path);
+db_index *db_index_open(char *db_path);
+int db_index_check(db_index *idx, size_t base, size_t size);
+char *db_index_find(database *db, char *key);
+
+#endif /* __DB_INDEX_H__ */
@@ -0,0 +1,86 @@
+#include "csapp/csapp.h"
+#include "utils.h"
+#include "postings.h"
+#include "db_index.h"
+
+/* Offline helper for preparing database files for db_server. */
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s compress [input_db] [output_db]\n", prog);
+  fprintf(stderr, "       %s index [db]\n", prog);
+  exit(1);
+}
+
+/** @brief Writes len bytes followed by zero padding up to a multiple of the
+ *         size of an int, so that every entry in the output stays aligned.
+ */
+static void write_padded(FILE *out, const void *buf, size_t len) {
+  static const char zeros[sizeof(int)];
+  if (fwrite(buf, 1, len, out) != len
+      || fwrite(zeros, 1, round_up(len, sizeof(int)) - len, out) != round_up(len, sizeof(int)) - len) {
+    fprintf(stderr, "write error: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+/** @brief Converts a DB_FORMAT_RAW database into the block-compressed
+ *         DB_FORMAT_BLOCKS format, keeping the order of the entries.
+ */
+static void compress_db(char *in_path, char *out_path) {
+  database *db = load_database(in_path);
+  db_header hdr;
+  FILE *out;
+  size_t in_size = db->db_size, out_size = sizeof(db_header);
+
+  if (db->format != DB_FORMAT_RAW) {
+    fprintf(stderr, "%s is already compressed\n", in_path);
+    exit(1);
+  }
+  if ((out = fopen(out_path, "wb")) == NULL) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    exit(1);
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DB_MAGIC, DB_MAGIC_LEN);
+  hdr.format = DB_FORMAT_BLOCKS;
+  hdr.block_size = POSTING_BLOCK;
+  write_padded(out, &hdr, sizeof(hdr));
+
+  for (char *entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry)) {
+    value_array *va = get_value_array(entry);
+    size_t size = block_postings_size(va->arr, va->len);
+    block_postings *bp = Malloc(size);
+    block_postings_encode(va->arr, va->len, bp);
+    write_padded(out, entry, strlen(entry) + 1);
+    write_padded(out, bp, size);
+    out_size += round_up(strlen(entry) + 1, sizeof(int)) + round_up(size, sizeof(int));
+    free(bp);
+  }
+  if (fclose(out) != 0) {
+    fprintf(stderr, "write error: %s\n", strerror(errno));
+    exit(1);
+  }
+  Munmap(db->map_ptr, db->map_size);
+  fprintf(stderr, "%s: %zu bytes -> %s: %zu bytes\n", in_path, in_size, out_path, out_size);
+}
+
+/** @brief Writes the prebuilt hash index of a database next to it. */
+static void index_db(char *path) {
+  database *db = load_database(path);
+  int nkeys;
+
+  if ((nkeys = db_index_build(db, path)) < 0)
+    exit(1);
+  Munmap(db->map_ptr, db->map_size);
+  fprintf(stderr, "%s: indexed %d keys in %s%s\n", path, nkeys, path, DB_INDEX_SUFFIX);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && strcmp(argv[1], "compress") == 0)
+    compress_db(argv[2], argv[3]);
+  else if (argc == 3 && strcmp(argv[1], "index") == 0)
+    index_db(argv[2]);
+  else
+    usage(argv[0]);
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include "csapp/csapp.h"
+#include "mph.h"
+
+/** @brief The splitmix64 finaliser. */
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+/** @brief Hash of a key under the seed of an index. */
+static inline uint64_t mph_hash(const mph *f, const char *key) {
+  return mix64(hash_key(key, strlen(key)) ^ f->seed);
+}
+
+/** @brief Bucket of a hash. As in PTHash, 60% of the keys go to the first 30%
+ *         of the buckets, so that the large buckets are placed while the table
+ *         is still mostly empty.
+ */
+static inline uint32_t mph_bucket(const mph *f, uint64_t h) {
+  uint32_t hi = h >> 32, dense = f->nbuckets * 3 / 10;
+  if (dense == 0)
+    return hi % f->nbuckets;
+  if (hi < (uint32_t) (0.6 * UINT32_MAX))
+    return (uint32_t) h % dense;
+  return dense + (uint32_t) h % (f->nbuckets - dense);
+}
+
+/** @brief Position of a hash in the table of m when its bucket has pilot p. */
+static inline uint32_t mph_position(const mph *f, uint64_t h, uint32_t p) {
+  return (h ^ mix64(p)) % f->m;
+}
+
+/** @brief Finds a pilot for every bucket under the current seed, filling in
+ *         f->pilots and marking the positions taken in taken.
+ *
+ *  @param hashes hash of every key
+ *  @param order key indices grouped by bucket, with first[b] the start of
+ *         bucket b's group in order and first[nbuckets] == n
+ *  @param by_size buckets, largest first
+ *  @return 0 on success, or -1 if some bucket needs more than MPH_MAX_PILOT.
+ */
+static int place_buckets(mph *f, const uint64_t *hashes, const uint32_t *order,
+                         const uint32_t *first, const uint32_t *by_size,
+                         uint8_t *taken, uint32_t *pos) {
+  for (uint32_t i = 0; i < f->nbuckets; i++) {
+    uint32_t b = by_size[i], size = first[b + 1] - first[b], p, k, j;
+    if (size == 0)
+      break;
+    for (p = 0; p <= MPH_MAX_PILOT; p++) {
+      for (k = 0; k < size; k++) {
+        pos[k] = mph_position(f, hashes[order[first[b] + k]], p);
+        if (taken[pos[k]])
+          break;
+        for (j = 0; j < k && pos[j] != pos[k]; j++)
+          ;
+        if (j < k)
+          break;
+      }
+      if (k == size)
+        break;
+    }
+    if (p > MPH_MAX_PILOT)
+      return -1;
+    f->pilots[b] = p;
+    for (k = 0; k < size; k++)
+      taken[pos[k]] = 1;
+  }
+  return 0;
+}
+
+/** @brief Builds a minimal perfect hash index of a partition.
+ *
+ *  @param db the partition. Its entries must start at multiples of
+ *         sizeof(int) from db->m_ptr.
+ *  @return the index, or NULL if no seed worked, in which case the caller
+ *          should build a hash table instead.
+ */
+mph *mph_build(database *db) {
+  mph *f = Calloc(1, sizeof(mph));
+  uint64_t *hashes;
+  uint32_t *offsets, *order, *first, *by_size, *count, *pos;
+  uint32_t n = 0, max_size, r;
+  uint8_t *taken;
+  char *entry;
+
+  for (entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry))
+    n++;
+  f->n = n;
+  f->m = (uint32_t) (((uint64_t) n * 100 + MPH_ALPHA - 1) / MPH_ALPHA);
+  if (f->m == 0)
+    f->m = 1;
+  f->nbuckets = (uint64_t) MPH_C * n / (n > 1 ? 32 - __builtin_clz(n) : 1) + 1;
+  f->pilots = Calloc(f->nbuckets, sizeof(uint16_t));
+  f->slots = Malloc((n ? n : 1) * sizeof(uint32_t));
+  // positions past n that no key was placed at remap to slot 0, which then
+  // fails the key comparison
+  f->remap = Calloc(f->m - n + 1, sizeof(uint32_t));
+
+  hashes = Malloc((n + 1) * sizeof(uint64_t));
+  offsets = Malloc((n + 1) * sizeof(uint32_t));
+  order = Malloc((n + 1) * sizeof(uint32_t));
+  first = Malloc((f->nbuckets + 1) * sizeof(uint32_t));
+  by_size = Malloc(f->nbuckets * sizeof(uint32_t));
+  taken = Malloc(f->m);
+  n = 0;
+  for (entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry))
+    offsets[n++] = (entry - db->m_ptr) / sizeof(int);
+
+  for (f->seed = 0; f->seed < MPH_MAX_SEEDS; f->seed++) {
+    // group the keys by bucket with a counting sort
+    memset(first, 0, (f->nbuckets + 1) * sizeof(uint32_t));
+    max_size = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      hashes[i] = mph_hash(f, db->m_ptr + (size_t) offsets[i] * sizeof(int));
+      first[mph_bucket(f, hashes[i]) + 1]++;
+    }
+    for (uint32_t b = 0; b < f->nbuckets; b++) {
+      if (first[b + 1] > max_size)
+        max_size = first[b + 1];
+      first[b + 1] += first[b];
+    }
+    count = Calloc(f->nbuckets + 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t b = mph_bucket(f, hashes[i]);
+      order[first[b] + count[b]++] = i;
+    }
+    free(count);
+
+    // and the buckets by size, largest first
+    count = Calloc(max_size + 2, sizeof(uint32_t));
+    for (uint32_t b = 0; b < f->nbuckets; b++)
+      count[max_size - (first[b + 1] - first[b]) + 1]++;
+    for (uint32_t s = 0; s <= max_size; s++)
+      count[s + 1] += count[s];
+    for (uint32_t b = 0; b < f->nbuckets; b++)
+      by_size[count[max_size - (first[b + 1] - first[b])]++] = b;
+    free(count);
+
+    memset(taken, 0, f->m);
+    pos = Malloc((max_size + 1) * sizeof(uint32_t));
+    r = place_buckets(f, hashes, order, first, by_size, taken, pos);
+    free(pos);
+    if (r == 0)
+      break;
+  }
+
+  if (f->seed < MPH_MAX_SEEDS) {
+    // move the keys placed past n into the holes below it
+    uint32_t hole = 0;
+    for (uint32_t p = n; p < f->m; p++) {
+      if (!taken[p])
+        continue;
+      while (taken[hole])
+        hole++;
+      f->remap[p - n] = hole++;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t p = mph_position(f, hashes[i], f->pilots[mph_bucket(f, hashes[i])]);
+      f->slots[p < n ? p : f->remap[p - n]] = offsets[i];
+    }
+  } else {
+    free(f->pilots);
+    free(f->slots);
+    free(f->remap);
+    free(f);
+    f = NULL;
+  }
+  free(hashes);
+  free(offsets);
+  free(order);
+  free(first);
+  free(by_size);
+  free(taken);
+  return f;
+}
+
+/** @brief Looks a key up in the minimal perfect hash index of a partition.
+ *  @return A pointer to the start of the entry in the partition, or NULL if
+ *          the partition does not contain the key.
+ */
+char *mph_find(database *db, char *key) {
+  mph *f = db->mph;
+  uint64_t h;
+  uint32_t p;
+  char *entry;
+
+  if (f->n == 0)
+    return NULL;
+  h = mph_hash(f, key);
+  p = mph_position(f, h, f->pilots[mph_bucket(f, h)]);
+  if (p >= f->n)
+    p = f->remap[p - f->n];
+  entry = db->m_ptr + (size_t) f->slots[p] * sizeof(int);
+  return strcmp(entry, key) == 0 ? entry : NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef __MPH_H__
+#define __MPH_H__
+
+#include "utils.h"
+#include <stdint.h>
+
+/* A minimal perfect hash index of a partition, built in the style of PTHash.
+ * Keys are hashed into buckets of uneven size, and every bucket gets a pilot
+ * value that moves all of its keys to free positions of a table of
+ * MPH_ALPHA * n. Positions past the end of the n slots are remapped to the
+ * holes left below n, so every key has a slot of its own and a lookup is one
+ * slot read plus one key comparison. Overhead is the 16-bit pilots, about
+ * MPH_C / log2(n) * 16 bits per key, on top of the 32-bit slot per key. */
+
+// Average number of keys per bucket is log2(n) / MPH_C
+#define MPH_C 6
+// Load factor of the table the pilots place keys in, as a percentage
+#define MPH_ALPHA 99
+// Building gives up on a seed once a bucket needs a larger pilot than this
+#define MPH_MAX_PILOT 65535
+#define MPH_MAX_SEEDS 32
+
+typedef struct mph {
+  uint32_t n;        /* number of keys */
+  uint32_t m;        /* size of the table the pilots place keys in, >= n */
+  uint32_t nbuckets;
+  uint64_t seed;
+  uint16_t *pilots;  /* one per bucket */
+  uint32_t *remap;   /* slot of each position in [n, m) that holds a key */
+  uint32_t *slots;   /* offset of each key's entry from m_ptr, in ints */
+} mph;
+
+mph *mph_build(database *db);
+char *mph_find(database *db, char *key);
+
+#endif /* __MPH_H__ */
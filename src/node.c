@@ -1,21 +1,41 @@
 #include "csapp/csapp.h"
-#include "sbuf.h"
+#include "reactor.h"
 #include "utils.h"
 #include "cache.h"
+#include "peer.h"
+#include "postings.h"
+#include "db_index.h"
+#include "mph.h"
+#include "bloom.h"
+#include "prerender.h"
 #include <assert.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define NTHREADS 4
-#define SBUFSIZE 16
+// Threads that forward lookups to other nodes, so the NTHREADS workers never
+// wait on another node
+#define NFORWARDERS 16
 
-// You may assume that all requests sent to a node are less than this length
+// Requests sent to a node must be shorter than this, not counting the newline.
+// Longer ones are refused.
 #define REQUESTLINELEN 128
+// Maximum number of terms in a single request. Longer queries are refused.
+#define MAX_TERMS 16
+// Docids are formatted into a client's output this many at a time
+#define WRITE_VALUES_CHUNK 1024
 #define HOSTNAME "localhost"
 
 // Cache related constants
-#define MAX_OBJECT_SIZE 512 // object here refers to the posting list or result list being cached
-#define MAX_CACHE_SIZE MAX_OBJECT_SIZE*128
+#define MAX_OBJECT_SIZE (16 * 1024) // bytes of the largest posting list that is cached
+#define MAX_CACHE_SIZE (1024 * 1024) // bytes the cache may hold, entries included
+#define MAX_RESULT_SIZE (16 * 1024) // bytes of the largest query result that is cached
+#define MAX_RESULT_CACHE_SIZE (1024 * 1024)
+// The result cache's hits and misses are logged every this many lookups
+#define RESULT_STATS_INTERVAL 10000
 
 /* This struct contains all information needed for each node */
 typedef struct node_info {
@@ -34,6 +54,22 @@ int PARENT_PORT = 0;
 // Number of nodes that were created. Must be between 1 and 8 (inclusive).
 int TOTAL_NODES = 0;
 
+// Set by the --mmap option. Instead of streaming each partition through its
+// socket, the parent only tells every node where its partition lies in the
+// database file, and the node maps that range of the file itself.
+int MMAP_PARTITIONS = 0;
+
+// Set by the --index=mph option. Nodes then index their partition with a
+// minimal perfect hash instead of a hash table.
+int MPH_INDEX = 0;
+
+// Set by the --prerender option. Nodes then render the response line of every
+// entry of their partitions once at startup, and answer single-term lookups
+// of their keys by sending the line as it is. Lines of at least ZERO_COPY_MIN
+// bytes are sent without copying; shorter ones are still copied into the
+// connection's output, just not formatted again.
+int PRERENDER = 0;
+
 // A dynamically allocated array of TOTAL_NODES node_info structs.
 // The parent process creates this and populates it's values so when it creates
 // the nodes, they each know what port number the others are using.
@@ -47,14 +83,88 @@ node_info *NODES = NULL;
 // server this will be set to 0.
 int NODE_ID = -1;
 
-sbuf_t sbuf;
-
 Cache* cache;
-sem_t mutex, w;
-int readcnt = 0;
 
-// Each node will fill this struct in with it's own portion of the database.
-database partition = {NULL, 0, NULL};
+// Rendered results of multi-term queries, keyed by query_cache_key.
+Cache* results;
+long result_lookups = 0;
+
+// The key ranges of all partitions, received from the parent with the
+// partitions.
+routing_table ROUTES = {0, NULL};
+
+// Set by the --replicas=R option. Partition p is held by the R nodes p, p+1,
+// ..., p+R-1 (mod TOTAL_NODES), and reads of it are spread across them.
+int REPLICAS = 1;
+
+// Set by the --hedge=P option. A lookup forwarded to a replica that has not
+// answered within the P-th percentile of recent response times is sent to
+// another replica as well. 0 disables hedging.
+double HEDGE = HEDGE_PERCENTILE;
+
+// Indexed by partition id. Each node fills in the REPLICAS partitions it
+// holds; the others stay empty.
+database *partitions = NULL;
+
+// Bloom filters of the keys of each partition, indexed by partition id. A node
+// builds the filters of the partitions it holds, and fetches each of the
+// others from its replicas the first time it needs it (see partition_filter).
+bloom **filters = NULL;
+int *filter_state = NULL;
+#define FILTER_NONE 0
+#define FILTER_FETCHING 1
+#define FILTER_READY 2
+
+/** @brief Returns whether the given node holds a replica of partition p. */
+static int holds_partition(int node, int p) {
+  return (node - p + TOTAL_NODES) % TOTAL_NODES < REPLICAS;
+}
+
+/** @brief Maps db->db_size bytes of the database file, starting at the given
+ *         byte offset, as one of this node's partitions. The mapping has to
+ *         start on a page boundary, so it starts at the page holding offset
+ *         and db->m_ptr points into it. The pages are read in up front so
+ *         that the first queries do not fault them in one at a time.
+ *
+ *  @param db the partition to map
+ *  @param path path of the database file
+ *  @param offset offset of the partition in the file
+ */
+static void map_partition(database *db, char *path, size_t offset) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t skip = offset % page;
+  int fd;
+
+  if (db->db_size == 0) {
+    db->m_ptr = NULL;
+    return;
+  }
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    exit(1);
+  }
+  db->map_size = db->db_size + skip;
+  db->map_ptr = Mmap(NULL, db->map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                     fd, (off_t) (offset - skip));
+  Close(fd);
+  madvise(db->map_ptr, db->map_size, MADV_WILLNEED);
+  db->m_ptr = db->map_ptr + skip;
+}
+
+/** @brief Reads the routing table the parent sends after the first line of
+ *         its response into ROUTES.
+ */
+static void read_routes(rio_t *rio) {
+  char line[MAXLINE];
+  Rio_readlineb(rio, line, MAXLINE);
+  ROUTES.nbounds = atoi(line);
+  ROUTES.bounds = Calloc(ROUTES.nbounds + 1, sizeof(char *));
+  for (int i = 0; i < ROUTES.nbounds; i++) {
+    Rio_readlineb(rio, line, MAXLINE);
+    line[strcspn(line, "\n")] = '\0';
+    ROUTES.bounds[i] = strdup(line);
+  }
+}
 
 /** @brief Called by a child process (node) when it wants to request its partition
  *         of the database from the parent process. This will be called ONCE by 
@@ -65,18 +175,34 @@ database partition = {NULL, 0, NULL};
  *           stored as an int in PARENT_PORT.
  *         - Send a request line to the parent. The request needs to be a string
  *           of the form "<nodeid>\n" (the ID of the node followed by a newline) 
- *         - Read the response of the parent process. The response will start 
- *           with the size of the partition followed by a newline. After the 
- *           newline character, the next size bytes of the response will be this
- *           node's partition of the database.
- *         - Set the global partition variable. 
+ *         - Read the response of the parent process. It starts with a
+ *           "<format> <count> <path>" line giving the format and path of the
+ *           database file and the number of partitions this node holds.
+ *         - Read the routing table of all partitions that follows that line
+ *           (see read_routes).
+ *         - For each partition, read a "<id> <size> <offset>" line giving its
+ *           size and its offset in the database file, then its size bytes
+ *           into partitions[id]. When the parent runs with --mmap no
+ *           partition bytes are sent, and the node maps each partition
+ *           read-only from the file with map_partition instead.
+ *
+ *         If the database file has a prebuilt index (see db_index.h) the node
+ *         uses it instead of building hash tables of its partitions, for
+ *         every partition whose part of the index is intact, unless a
+ *         minimal perfect hash index was asked for with --index=mph.
+ *         With --prerender the response lines of every partition are then
+ *         rendered (see prerender.h).
  */
 void request_partition(void) {
   // TODO: implement this function. 
   int child_fd;
   char request[REQUESTLINELEN];
   char port_name[REQUESTLINELEN];
-  char size[REQUESTLINELEN];
+  char line[MAXLINE];
+  char path[MAXLINE];
+  int format, count, id;
+  size_t size, offset;
+  db_index *index = NULL;
   rio_t rio;
   // create request string <nodeid>\n
   sprintf(request, "%d\n", NODE_ID);
@@ -96,156 +222,725 @@ void request_partition(void) {
 
   Rio_readinitb(&rio, child_fd);
   Rio_writen(child_fd, request, strlen(request));
-  // read in size of the db
-  Rio_readlineb(&rio, size, sizeof(size_t));
-
-  sscanf(size, "%zu", &(partition.db_size));
+  // read in the format of the db and the number of partitions
+  Rio_readlineb(&rio, line, MAXLINE);
+  if (sscanf(line, "%d %d %[^\n]", &format, &count, path) != 3) {
+    fprintf(stderr, "Invalid partition response from parent.\n");
+    exit(1);
+  }
+  read_routes(&rio);
+  if (!MPH_INDEX)
+    index = db_index_open(path);
 
-  // read in database
-  partition.m_ptr = malloc(partition.db_size);
-  Rio_readnb(&rio, partition.m_ptr, partition.db_size);
+  partitions = Calloc(TOTAL_NODES, sizeof(database));
+  filters = Calloc(TOTAL_NODES, sizeof(bloom *));
+  filter_state = Calloc(TOTAL_NODES, sizeof(int));
+  for (int i = 0; i < count; i++) {
+    Rio_readlineb(&rio, line, MAXLINE);
+    if (sscanf(line, "%d %zu %zu", &id, &size, &offset) != 3 || id < 0 || id >= TOTAL_NODES) {
+      fprintf(stderr, "Invalid partition response from parent.\n");
+      exit(1);
+    }
+    database *db = &partitions[id];
+    db->format = format;
+    db->db_size = size;
+    db->base = offset;
+    if (MMAP_PARTITIONS) {
+      map_partition(db, path, offset);
+    } else {
+      // read in database
+      db->m_ptr = malloc(size);
+      Rio_readnb(&rio, db->m_ptr, size);
+    }
 
-  build_hash_table(&partition);
+    if (MPH_INDEX && (db->mph = mph_build(db)) != NULL)
+      fprintf(stderr, "NODE %d using a perfect hash of %u keys for partition %d\n", NODE_ID, db->mph->n, id);
+    else if (index != NULL && db_index_check(index, offset, size) == 0) {
+      db->index = index;
+      fprintf(stderr, "NODE %d using prebuilt index of %s for partition %d\n", NODE_ID, path, id);
+    } else {
+      build_hash_table(db);
+    }
+    filters[id] = bloom_build(db);
+    filter_state[id] = FILTER_READY;
+    if (PRERENDER) {
+      db->rendered = prerender_build(db);
+      fprintf(stderr, "NODE %d prerendered %zu bytes of responses for partition %d\n",
+              NODE_ID, db->rendered->text_len, id);
+    }
+  }
   Close(child_fd);
   
 }
 
+/** @brief Sends a request to one of the replicas of partition p. The replica
+ *         is picked by peer_pick. If it is slow to answer the request is
+ *         hedged to the next replica, and if it cannot be reached the others
+ *         are tried in turn.
+ *  @param payload the key of a PEER_LOOKUP, or the partition id of a
+ *         PEER_FILTER
+ *  @return the response payload, which the caller must free, or NULL if no
+ *          replica could be reached.
+ */
+static char *forward_request(int p, int op, char *payload, uint32_t *len) {
+  int replicas[TOTAL_NODES], order[TOTAL_NODES], first;
+
+  for (int r = 0; r < REPLICAS; r++)
+    replicas[r] = (p + r) % TOTAL_NODES;
+  first = peer_pick(replicas, REPLICAS);
+  for (int r = 0; r < REPLICAS; r++)
+    order[r] = replicas[(first + r) % REPLICAS];
+  return peer_call_hedged(order, REPLICAS, op, payload, strlen(payload), len);
+}
+
+/** @brief Fetches the Bloom filter of partition p from one of its replicas.
+ *         Runs on a thread of its own, so that no reactor worker waits for
+ *         the answer.
+ */
+static void *fetch_filter(void *vargp) {
+  int p = (int) (intptr_t) vargp, state = FILTER_NONE;
+  char id[16];
+  char *response;
+  uint32_t len;
+
+  Pthread_detach(pthread_self());
+  sprintf(id, "%d", p);
+  response = forward_request(p, PEER_FILTER, id, &len);
+  if (response && (filters[p] = bloom_unpack(response, len)) != NULL)
+    state = FILTER_READY;
+  // on failure the next lookup tries again
+  __atomic_store_n(&filter_state[p], state, __ATOMIC_RELEASE);
+  free(response);
+  return NULL;
+}
+
+/** @brief Returns the Bloom filter of partition p. The first thread to ask for
+ *         the filter of a partition this node does not hold starts fetching it
+ *         from a replica; lookups carry on without it in the meantime.
+ *  @return the filter, or NULL if it has not been fetched yet.
+ */
+static bloom *partition_filter(int p) {
+  int state = FILTER_NONE;
+  pthread_t tid;
+
+  if (__atomic_load_n(&filter_state[p], __ATOMIC_ACQUIRE) == FILTER_READY)
+    return filters[p];
+  if (__atomic_compare_exchange_n(&filter_state[p], &state, FILTER_FETCHING, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    Pthread_create(&tid, NULL, fetch_filter, (void *) (intptr_t) p);
+  return NULL;
+}
+
+/* A posting list fetched from another node for the request a connection is
+ * answering. The connection is parked until the list arrives, and keeps it
+ * until the request has been answered, however many times the handler runs
+ * for it. */
+typedef struct fetched {
+  char *key;
+  conn *c;
+  value_array *va;          /* NULL if the key was not found or no replica answered */
+  int done;                 /* set atomically once va is filled in */
+  struct fetched *next;     /* next list fetched for the same request */
+  struct fetched *waiting;  /* next fetch waiting on the same flight */
+} fetched;
+
+/* A lookup being forwarded. Connections that miss the cache on a key whose
+ * lookup is already in flight wait for its response instead of forwarding it
+ * again. Lookups are forwarded by NFORWARDERS threads of their own, so the
+ * reactor's workers never wait on another node. */
+typedef struct flight {
+  char *key;
+  int p;                    /* partition of the key */
+  fetched *waiters;
+  struct flight *next;      /* chain in flights */
+  struct flight *queued;    /* next flight waiting for a forwarder */
+} flight;
+
+#define FLIGHT_BUCKETS 64
+flight *flights[FLIGHT_BUCKETS];
+// Flights that no forwarder has taken yet, oldest first
+flight *forward_head = NULL, *forward_tail = NULL;
+pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t forward_ready = PTHREAD_COND_INITIALIZER;
+
+/** @brief Makes w wait for the lookup of its key in flight, or starts a lookup
+ *         if there is none.
+ *  @param p partition of the key
+ *  @return the new lookup if the caller started it, and so must pass it to
+ *          flight_start or flight_finish, or NULL if w joined one in flight.
+ */
+static flight *flight_join(int p, fetched *w) {
+  flight **bucket = &flights[hash_key(w->key, strlen(w->key)) % FLIGHT_BUCKETS];
+  flight *f, *started = NULL;
+
+  pthread_mutex_lock(&flight_lock);
+  for (f = *bucket; f != NULL && strcmp(f->key, w->key) != 0; f = f->next)
+    ;
+  if (f == NULL) {
+    f = started = Calloc(1, sizeof(flight));
+    f->key = strdup(w->key);
+    f->p = p;
+    f->next = *bucket;
+    *bucket = f;
+  }
+  w->waiting = f->waiters;
+  f->waiters = w;
+  pthread_mutex_unlock(&flight_lock);
+  return started;
+}
+
+/** @brief Queues a lookup started by flight_join for a forwarder. */
+static void flight_start(flight *f) {
+  pthread_mutex_lock(&flight_lock);
+  if (forward_tail)
+    forward_tail->queued = f;
+  else
+    forward_head = f;
+  forward_tail = f;
+  pthread_cond_signal(&forward_ready);
+  pthread_mutex_unlock(&flight_lock);
+}
+
+/** @brief Hands the result of a lookup to every connection waiting for it,
+ *         resumes them, and takes the lookup out of flights, so that later
+ *         misses forward again.
+ *  @param va the posting list, or NULL if the key was not found or no replica
+ *         answered. Each waiter gets a copy.
+ */
+static void flight_finish(flight *f, const value_array *va) {
+  flight **link = &flights[hash_key(f->key, strlen(f->key)) % FLIGHT_BUCKETS];
+  size_t size = va ? sizeof(value_array) + va->len * sizeof(unsigned int) : 0;
+  fetched *w, *next;
+
+  pthread_mutex_lock(&flight_lock);
+  while (*link != f)
+    link = &(*link)->next;
+  *link = f->next;
+  pthread_mutex_unlock(&flight_lock);
+
+  for (w = f->waiters; w != NULL; w = next) {
+    // a resumed connection may free w straight away
+    next = w->waiting;
+    if (va) {
+      w->va = Malloc(size);
+      memcpy(w->va, va, size);
+    }
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    conn_resume(w->c);
+  }
+  free(f->key);
+  free(f);
+}
+
+/** @brief Forwards the lookups queued by flight_start, one at a time, and
+ *         caches their results. Only the forwarder of a key fills the cache.
+ */
+static void *forwarder(void *vargp) {
+  value_array *va;
+  char *response;
+  uint32_t len;
+  flight *f;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&flight_lock);
+    while (forward_head == NULL)
+      pthread_cond_wait(&forward_ready, &flight_lock);
+    f = forward_head;
+    if ((forward_head = f->queued) == NULL)
+      forward_tail = NULL;
+    pthread_mutex_unlock(&flight_lock);
+
+    response = forward_request(f->p, PEER_LOOKUP, f->key, &len);
+    // an empty response means the owner does not have the key
+    va = (response && len > 0) ? value_array_unpack(response, len) : NULL;
+    if (va)
+      write_cache(cache, f->key, va, sizeof(value_array) + va->len * sizeof(unsigned int));
+    else if (response && len == 0)
+      write_cache(cache, f->key, "", 0);
+    flight_finish(f, va);
+    free(va);
+    free(response);
+  }
+  return NULL;
+}
+
+/** @brief Frees the posting lists fetched for the request of a connection. */
+static void release_fetched(void *data) {
+  fetched *w = data, *next;
+  for (; w != NULL; w = next) {
+    next = w->next;
+    free(w->key);
+    free(w->va);
+    free(w);
+  }
+}
+
+/** @brief Drops the reference a posting list holds on a cache entry. */
+static void release_cached(void *node) {
+  release_cache(node);
+}
+
+/** @brief Lends the value of a cache entry to a posting list until the list
+ *         is freed. An entry with no value records that the key is not in the
+ *         database.
+ *  @return 1 if the key was found, 0 if not.
+ */
+static int borrow_cached(CacheNode* cached, posting_list* pl) {
+  if (cached->size == 0) {
+    release_cache(cached);
+    return 0;
+  }
+  pl->va = cached->value;
+  pl->len = pl->va->len;
+  pl->ref = cached;
+  pl->release = release_cached;
+  return 1;
+}
+
+/**
+ * This function is to search for the posting list of a key in the whole
+ * database (including other nodes). It will ask the owner node if necessary,
+ * which answers with the packed value array rather than its text form. Lists
+ * in a block-compressed local partition are returned still encoded.
+ * The connection is parked while the owner is asked, and the list is then
+ * returned when the handler runs again for the same request.
+ * @param pl filled in with the posting list. Release it with posting_list_free.
+ * @return 1 if found; 0 if not found; -1 if it is being fetched and the
+ * connection has been parked
+*/
+int get_postings(conn* c, char* key, posting_list* pl) {
+  char* result_offset;
+  CacheNode* cached;
+  bloom* filter;
+  fetched* w;
+  flight* f;
+  int p = find_node(&ROUTES, key);
+
+  memset(pl, 0, sizeof(posting_list));
+  // find inside this node, which is the only place to look if it holds the
+  // key's partition
+  if (holds_partition(NODE_ID, p)) {
+    if ((result_offset = find_entry(&partitions[p], key)) == NULL)
+      return 0;
+    if (partitions[p].format == DB_FORMAT_BLOCKS) {
+      pl->blocks = get_block_postings(result_offset);
+      pl->len = pl->blocks->len;
+    } else {
+      pl->va = get_value_array(result_offset);
+      pl->len = pl->va->len;
+    }
+    return 1;
+  }
+
+  // the partition's filter rules out most of the keys it does not hold
+  if ((filter = partition_filter(p)) != NULL && !bloom_may_contain(filter, key))
+    return 0;
+
+  // a list fetched for this request is lent until the request is answered
+  for (w = c->data; w != NULL; w = w->next) {
+    if (strcmp(w->key, key) != 0)
+      continue;
+    if (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE))
+      return -1;
+    if (w->va == NULL)
+      return 0;
+    pl->va = w->va;
+    pl->len = w->va->len;
+    return 1;
+  }
+
+  // find in cache
+  if ((cached = lookup_cache(cache, key)) != NULL)
+    return borrow_cached(cached, pl);
+
+  // if not cached, park the connection until one of the nodes that hold the
+  // partition has answered, or until the lookup already in flight for the
+  // key has finished
+  w = Calloc(1, sizeof(fetched));
+  w->key = strdup(key);
+  w->c = c;
+  w->next = c->data;
+  c->data = w;
+  c->release = release_fetched;
+  conn_suspend(c);
+  if ((f = flight_join(p, w)) != NULL) {
+    // a lookup that finished after this connection missed the cache filled it
+    if ((cached = lookup_cache(cache, key)) != NULL) {
+      flight_finish(f, cached->size ? cached->value : NULL);
+      release_cache(cached);
+    } else {
+      flight_start(f);
+    }
+  }
+  return -1;
+}
+
+/** @brief Writes the values of a list to a client, each preceded by a ',' and
+ *         followed by a newline. They are formatted straight into the output
+ *         of the connection, WRITE_VALUES_CHUNK values at a time, so a long
+ *         list is never held as text in full.
+ */
+static void write_values(conn *c, value_array *va) {
+  for (int i = 0; i < va->len; i += WRITE_VALUES_CHUNK) {
+    int n = MIN(va->len - i, WRITE_VALUES_CHUNK);
+    conn_commit(c, values_to_str(va->arr + i, n, conn_reserve(c, n * VALUE_STR_MAX)));
+  }
+  conn_write(c, "\n", 1);
+}
+
+/** @brief Writes the "not found" line of a key to a client. */
+static void write_not_found(conn *c, char *key) {
+  conn_write(c, key, strlen(key));
+  conn_write(c, " not found\n", strlen(" not found\n"));
+}
+
 /** 
  * This function is to search whether the key is in the whole database (including
  * other nodes). It will connect to other nodes if necessary.
- * This works only for one node.
- * @return formatted string if found; NULL if not found
+ * Writes the key followed by its docids to the client, or a "not found" line.
+ * @return 1 if the request was answered, 0 if the connection was parked until
+ * the key has been fetched
 */
-char* get_one_result_string(char* key) {
+int write_one_result(conn* c, char* key) {
+  posting_list pl;
+  int p = find_node(&ROUTES, key), found;
+  const char* line;
+  uint32_t len;
 
-  char* result_offset;
-  char* result = (char*) malloc(2048);
-  rio_t rio;  
-  // find inside this node
-  result_offset = find_entry(&partition, key);
-  // if found inside this node
-  if (result_offset) {
-    entry_to_str(result_offset, result, 2048);
-    return result;
+  // a key of a prerendered partition is sent as rendered at startup
+  if (holds_partition(NODE_ID, p) && partitions[p].rendered != NULL) {
+    if ((line = prerender_find(&partitions[p], key, &len)) == NULL)
+      write_not_found(c, key);
+    else
+      conn_write_static(c, line, len);
+    return 1;
   }
 
-  // find in cache
-  char* temp = NULL;
-  temp = lookup_cache(cache, key, &mutex, &w, &readcnt);
-  if (temp != NULL) {
-    strcpy(result, temp);
-    free(temp);
-    return result;
-  }
-
-
-  // if not found inside this node, connect with other node
-  int id = find_node(key, TOTAL_NODES);
-  if (NODE_ID != id) {
-    char port_name[128];
-    port_number_to_str(NODES[id].port_number, port_name);
-    int fd = Open_clientfd(HOSTNAME, port_name);
-    // get result from other node
-    Rio_readinitb(&rio, fd);    
-    char temp[2048];
-    strcpy(temp, key);
-    strcat(temp, "\n");
-    write(fd, temp, strlen(temp));
-    Rio_readlineb(&rio, result, 2048);
-    Close(fd);
-    // if found, store in cache and return the result
-    if (is_found(key, result)) {
-      write_cache(cache, key, result, &mutex, &w);
-      return result;
-    }
+  if ((found = get_postings(c, key, &pl)) < 0)
+    return 0;
+  if (!found) {
+    write_not_found(c, key);
+    return 1;
+  }
+
+  conn_write(c, key, strlen(key));
+  write_values(c, posting_list_values(&pl));
+  posting_list_free(&pl);
+  return 1;
+}
+
+/** @brief qsort comparator for an array of terms. */
+static int cmp_terms(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+/** @brief Writes the key a query is cached under to buf. Queries that differ
+ *         only in the order of their terms or of their OR groups have the same
+ *         result, so the key is the groups, each with its terms sorted, in
+ *         sorted order and separated by " |", followed by the sorted negated
+ *         terms.
+ *
+ *  @param keys the positive terms, then unused slots, then the negated terms
+ *         from the back, as laid out by write_query_result
+ *  @param group_start index in keys of the first term of each group, followed
+ *         by npos
+ *  @param buf at least REQUESTLINELEN + 2 * MAX_TERMS bytes
+ */
+static void query_cache_key(char **keys, int *group_start, int ngroups, int nneg,
+                            char *buf) {
+  char *sorted[MAX_TERMS], *groups[MAX_TERMS];
+  char group_buf[REQUESTLINELEN + 2 * MAX_TERMS];
+  int len = 0, glen = 0;
+
+  for (int g = 0; g < ngroups; g++) {
+    int nterms = group_start[g + 1] - group_start[g];
+    memcpy(sorted, keys + group_start[g], nterms * sizeof(char *));
+    qsort(sorted, nterms, sizeof(char *), cmp_terms);
+    groups[g] = group_buf + glen;
+    for (int i = 0; i < nterms; i++)
+      glen += sprintf(group_buf + glen, " %s", sorted[i]);
+    glen++;
+  }
+  qsort(groups, ngroups, sizeof(char *), cmp_terms);
+  buf[0] = '\0';
+  for (int g = 0; g < ngroups; g++)
+    len += sprintf(buf + len, g == 0 ? "%s" : " |%s", groups[g]);
+  memcpy(sorted, keys + MAX_TERMS - nneg, nneg * sizeof(char *));
+  qsort(sorted, nneg, sizeof(char *), cmp_terms);
+  for (int i = 0; i < nneg; i++)
+    len += sprintf(buf + len, " -%s", sorted[i]);
+}
+
+/** @brief Counts a lookup in the result cache, and logs its hits and misses
+ *         every RESULT_STATS_INTERVAL lookups.
+ */
+static void count_result_lookup(void) {
+  long hits, misses;
+  if (__atomic_add_fetch(&result_lookups, 1, __ATOMIC_RELAXED) % RESULT_STATS_INTERVAL == 0) {
+    cache_stats(results, &hits, &misses);
+    fprintf(stderr, "NODE %d result cache: %ld hits, %ld misses\n", NODE_ID, hits, misses);
   }
-  // not found, return null
-  free(result);
-  return NULL;
 }
 
 /**
- * This function will return the result of the two-term request directly.
- * @return result to return to the client. No need to create "not found" string
- *  if not found.
+ * This function will write the result of a multi-term request to the client.
+ * Terms are combined with AND, and "|" separates groups of them that are
+ * combined with OR, so AND binds tighter: "a b | c" is (a AND b) OR c. Terms
+ * prefixed with '-' are excluded from the whole result (AND NOT), whichever
+ * group they are written in. All posting lists are fetched first, so that
+ * every missing term can be reported. The docids of a query whose terms were
+ * all found are kept in the result cache, so a repeat of the query, with its
+ * terms in any order, needs no lookups or merging.
+ * The response is one "not found" line per missing term if no group has all
+ * its terms, or the query followed by the result docids.
+ * @return 1 if the request was answered, 0 if the connection was parked until
+ * the terms held by other nodes have been fetched
 */
-char* get_two_result(char* key1, char* key2) {
-  char* result1 = get_one_result_string(key1);
-  char* result2 = get_one_result_string(key2);
-  char* final_result;
-  // if neither found
-  if(!result1 && !result2) {
-    final_result = generate_two_not_found(key1, key2);
-    return final_result;
-  }
-  // if only one found
-  if(!result1) {
-    final_result = generate_not_found(key1);
-    return final_result;
-  }
-  if(!result2) {
-    final_result = generate_not_found(key2);
-    return final_result;
-  }
-  // if all found
-  value_array* va1 = create_value_array(result1);
-  value_array* va2 = create_value_array(result2);
-  value_array* intersection = get_intersection(va1, va2);
-
-  // delete \n at the end as it might be added one when requesting from other nodes
-  request_line_to_key(key1);
-  request_line_to_key(key2);
-  // generate final response string
-  final_result = (char*) malloc(2048);
-  sprintf(final_result, "%s,%s", key1, key2);
-  char str[2048];
-  value_array_to_str(intersection, str, 2048);
-  strcat(final_result, str);
+int write_query_result(conn* c, char** terms, int n) {
+  char* keys[MAX_TERMS];
+  posting_list lists[MAX_TERMS];
+  value_array* values[MAX_TERMS];
+  value_array* matches[MAX_TERMS];
+  int found[MAX_TERMS], owned[MAX_TERMS], group_start[MAX_TERMS + 1];
+  int npos = 0, nneg = 0, ngroups = 0, nmatches = 0, missing = 0, parked = 0;
+  int len = 0, new_group = 1;
+
+  // positive terms fill keys from the front, negated terms from the back.
+  // Groups with no positive terms are dropped.
+  for (int i = 0; i < n; i++) {
+    if (strcmp(terms[i], "|") == 0) {
+      new_group = 1;
+    } else if (terms[i][0] == '-' && terms[i][1] != '\0') {
+      keys[MAX_TERMS - 1 - nneg++] = terms[i] + 1;
+    } else {
+      if (new_group)
+        group_start[ngroups++] = npos;
+      new_group = 0;
+      keys[npos++] = terms[i];
+    }
+  }
+  if (npos == 0) {
+    conn_write(c, "invalid query\n", strlen("invalid query\n"));
+    return 1;
+  }
+  group_start[ngroups] = npos;
+
+  // the query as the client wrote it, which the result docids follow
+  char prefix[REQUESTLINELEN + 2 * MAX_TERMS];
+  for (int g = 0; g < ngroups; g++)
+    for (int i = group_start[g]; i < group_start[g + 1]; i++)
+      len += sprintf(prefix + len, i > group_start[g] ? ",%s" : (g > 0 ? "|%s" : "%s"), keys[i]);
+  for (int i = MAX_TERMS - 1; i >= MAX_TERMS - nneg; i--)
+    len += sprintf(prefix + len, ",-%s", keys[i]);
+
+  char cache_key[REQUESTLINELEN + 2 * MAX_TERMS];
+  CacheNode* cached;
+  query_cache_key(keys, group_start, ngroups, nneg, cache_key);
+  // a request that has fetched lists already missed the result cache
+  if (c->data == NULL) {
+    count_result_lookup();
+    if ((cached = lookup_cache(results, cache_key)) != NULL) {
+      conn_write(c, prefix, len);
+      conn_write(c, cached->value, cached->size);
+      release_cache(cached);
+      return 1;
+    }
+  }
+
+  // the lists of the positive terms keep their places, those of the excluded
+  // terms that were found follow them
+  for (int i = 0; i < npos; i++) {
+    found[i] = get_postings(c, keys[i], &lists[i]);
+    missing += found[i] == 0;
+    parked |= found[i] < 0;
+  }
+  int nex = 0;
+  for (int i = MAX_TERMS - nneg; i < MAX_TERMS; i++) {
+    int got = get_postings(c, keys[i], &lists[npos + nex]);
+    nex += got > 0;
+    parked |= got < 0;
+  }
+  // the query is evaluated once all the lists held by other nodes are here
+  if (parked) {
+    for (int i = 0; i < npos + nex; i++)
+      posting_list_free(&lists[i]);
+    return 0;
+  }
+
+  // a group only matches if all of its terms were found
+  for (int g = 0; g < ngroups; g++) {
+    int start = group_start[g], nterms = group_start[g + 1] - start, all = 1;
+    for (int i = start; i < start + nterms; i++)
+      all &= found[i];
+    if (!all)
+      continue;
+    // only the blocks of compressed lists that can match are decoded
+    owned[nmatches] = nterms > 1;
+    matches[nmatches++] = nterms > 1 ? postings_intersect_all(lists + start, nterms)
+                                     : posting_list_values(&lists[start]);
+  }
+
+  if (nmatches == 0) {
+    for (int i = 0; i < npos; i++)
+      if (!found[i])
+        write_not_found(c, keys[i]);
+  } else {
+    value_array* result;
+    for (int i = 0; i < nex; i++)
+      values[i] = posting_list_values(&lists[npos + i]);
+    if (nmatches == 1 && owned[0] && nex == 0) {
+      result = matches[0];
+      owned[0] = 0;
+    } else {
+      result = postings_union_minus(matches, nmatches, values, nex);
+    }
+    conn_write(c, prefix, len);
+    // a term may only look missing because its owner did not answer, so only
+    // results with every term found are cached. Those that may fit in the
+    // cache are rendered once, for both the client and the cache.
+    if (missing == 0 && nex == nneg && (size_t) result->len * VALUE_STR_MAX < MAX_RESULT_SIZE) {
+      char* ids = Malloc(values_str_len(result->arr, result->len) + 1);
+      int n_ids = values_to_str(result->arr, result->len, ids);
+      ids[n_ids++] = '\n';
+      conn_write(c, ids, n_ids);
+      write_cache(results, cache_key, ids, n_ids);
+      free(ids);
+    } else {
+      write_values(c, result);
+    }
+    free(result);
+  }
   // free memories
-  free(va1);
-  free(va2);
-  free(result1);
-  free(result2);
-  free(intersection);
-  return final_result;
+  for (int i = 0; i < nmatches; i++)
+    if (owned[i])
+      free(matches[i]);
+  for (int i = 0; i < npos + nex; i++)
+    posting_list_free(&lists[i]);
+  return 1;
 }
 
 
-void *thread(void *vargp) {
-  Pthread_detach(pthread_self());
+/** @brief Handles one frame sent by a peer node. Peers only forward keys whose
+ *         partition this node holds, so lookups are answered locally and never
+ *         forwarded again. A lookup or filter request about a partition this
+ *         node does not hold is answered with PEER_UNAVAILABLE.
+ *
+ *  @return number of bytes consumed, or 0 if no complete frame is buffered yet.
+ */
+size_t handle_peer_frame(conn *c, char *buf, size_t len) {
+  char hdr_buf[PEER_HDR_LEN];
   char key[REQUESTLINELEN];
-  rio_t rio;
-  int connfd, n;
+  char *entry, *packed = NULL;
+  uint32_t plen = 0;
+  peer_hdr hdr;
+  int n, op, owned;
 
-  while (1) {
-    connfd = sbuf_remove(&sbuf);
-    Rio_readinitb(&rio, connfd);    
-    while ((n = Rio_readlineb(&rio, key, REQUESTLINELEN)) > 0){
-      char space = ' ';
-      // if one term search
-      if (!(strchr(key, space))) {
-        request_line_to_key(key);
-        char *result = get_one_result_string(key);
-        if (result) {
-          rio_writen(connfd, result, strlen(result));
-          free(result);
-        } else {
-          result = generate_not_found(key);
-          rio_writen(connfd, result, strlen(result));
-          free(result);
-        }
-      } else {  // two term search
-        char* key1 = strtok(key, " ");
-        char* key2 = strtok(NULL, " ");
-        request_line_to_key(key1);
-        request_line_to_key(key2);
-        char* result = get_two_result(key1, key2);
-        rio_writen(connfd, result, strlen(result));
-        free(result);
+  if (!peer_decode_hdr(buf, len, &hdr) || len - PEER_HDR_LEN < hdr.len)
+    return 0;
+  if (hdr.op == PEER_LOOKUP) {
+    n = MIN(hdr.len, REQUESTLINELEN - 1);
+    memcpy(key, buf + PEER_HDR_LEN, n);
+    key[n] = '\0';
+    // the posting list is sent packed, or as an empty payload if not found.
+    // Only a node holding the key's partition can say it is not found.
+    int p = find_node(&ROUTES, key);
+    op = PEER_UNAVAILABLE;
+    if (holds_partition(NODE_ID, p)) {
+      op = PEER_LOOKUP;
+      if ((entry = find_entry(&partitions[p], key)) != NULL) {
+        value_array *va = get_entry_values(&partitions[p], entry, &owned);
+        packed = value_array_pack(va, &plen);
+        if (owned)
+          free(va);
+      }
+    }
+    peer_encode_hdr(hdr_buf, op, hdr.id, plen);
+    conn_write(c, hdr_buf, PEER_HDR_LEN);
+    if (packed)
+      conn_write(c, packed, plen);
+    free(packed);
+  } else if (hdr.op == PEER_FILTER) {
+    n = MIN(hdr.len, REQUESTLINELEN - 1);
+    memcpy(key, buf + PEER_HDR_LEN, n);
+    key[n] = '\0';
+    int p = atoi(key);
+    op = PEER_UNAVAILABLE;
+    if (p >= 0 && p < TOTAL_NODES && holds_partition(NODE_ID, p)) {
+      op = PEER_FILTER;
+      packed = bloom_pack(filters[p], &plen);
+    }
+    peer_encode_hdr(hdr_buf, op, hdr.id, plen);
+    conn_write(c, hdr_buf, PEER_HDR_LEN);
+    if (packed)
+      conn_write(c, packed, plen);
+    free(packed);
+  }
+  return PEER_HDR_LEN + hdr.len;
+}
+
+/** @brief Handles one request line from a client. Called by the reactor's
+ *         worker threads with the buffered input of a connection; the response
+ *         is queued on the connection with conn_write. Input that starts with
+ *         PEER_MAGIC is a frame from another node rather than a request line.
+ *
+ *  @return number of bytes consumed, or 0 if no complete line is buffered yet.
+ */
+size_t handle_request(conn *c, char *buf, size_t len, int eof) {
+  char key[REQUESTLINELEN];
+  char *nl;
+  size_t used;
+
+  if ((unsigned char) buf[0] == PEER_MAGIC)
+    return handle_peer_frame(c, buf, len);
+  nl = memchr(buf, '\n', len);
+  if (nl)
+    used = nl - buf + 1;
+  else if (eof || len >= REQUESTLINELEN)
+    used = len;
+  else
+    return 0;
+  if (used - (nl != NULL) >= REQUESTLINELEN) {
+    conn_write(c, "request too long\n", strlen("request too long\n"));
+    // the end of the line has not arrived, and is not waited for
+    if (nl == NULL)
+      conn_shutdown(c);
+    return used;
+  }
+  memcpy(key, buf, used);
+  key[used - (nl != NULL)] = '\0';
+
+  // a line of fewer than REQUESTLINELEN bytes holds at most REQUESTLINELEN / 2
+  // words, of which only the terms count towards MAX_TERMS, not the "|"s
+  char *terms[REQUESTLINELEN / 2], *save, *term;
+  int n = 0, nterms = 0, operators = 0, answered = 1;
+  for (term = strtok_r(key, " \r\n", &save); term;
+       term = strtok_r(NULL, " \r\n", &save)) {
+    if (strcmp(term, "|") == 0) {
+      operators = 1;
+    } else {
+      if (++nterms > MAX_TERMS) {
+        conn_write(c, "too many terms\n", strlen("too many terms\n"));
+        return used;
       }
+      operators |= term[0] == '-' && term[1] != '\0';
     }
-    Close(connfd);
+    terms[n++] = term;
   }
+
+  // a blank line is a query with no terms, and is answered as one
+  if (n == 0)
+    conn_write(c, "invalid query\n", strlen("invalid query\n"));
+  else if (n == 1 && !operators)  // one term search
+    answered = write_one_result(c, terms[0]);
+  else  // multi term search, or a query using "|" or "-"
+    answered = write_query_result(c, terms, n);
+  if (!answered)
+    return 0;
+  // the lists fetched for the request are not needed any more
+  release_fetched(c->data);
+  c->data = NULL;
+  return used;
 }
 
 /** @brief The main server loop for a node. This will be called by a node after
@@ -254,27 +949,17 @@ void *thread(void *vargp) {
  *
  *  @note  The parent process creates the listening socket that the node should
  *         use to accept incoming connections. This file descriptor is stored in
- *         NODES[NODE_ID].listen_fd. 
+ *         NODES[NODE_ID].listen_fd. Connections are multiplexed by an epoll
+ *         reactor over NTHREADS worker threads, so idle clients do not hold a
+ *         thread. Requests that wait on other nodes do not hold one either:
+ *         their connections are parked while NFORWARDERS other threads
+ *         forward the lookups.
 */
 void node_serve(void) {
-  // TODO: implement this function. 
-  int connfd;
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
-
   pthread_t tid;
-
-  sbuf_init(&sbuf, SBUFSIZE);
-  for (int i = 0; i < NTHREADS; i++)
-    Pthread_create(&tid, NULL, thread, NULL);
-
-  // start process loop
-  while (1) {
-    // accept with client
-    clientlen = sizeof(struct sockaddr_storage);
-    connfd = Accept(NODES[NODE_ID].listen_fd, (SA *) &clientaddr, &clientlen);
-    sbuf_insert(&sbuf, connfd);
-  }
+  for (int i = 0; i < NFORWARDERS; i++)
+    Pthread_create(&tid, NULL, forwarder, NULL);
+  reactor_run(NODES[NODE_ID].listen_fd, NTHREADS, handle_request);
 }
 
 
@@ -297,11 +982,21 @@ void start_node(int node_id) {
       Close(NODES[n].listen_fd);
   }
 
+  // a peer closing a pooled connection must not kill the node
+  Signal(SIGPIPE, SIG_IGN);
+
   request_partition();
+
+  int *ports = Malloc(TOTAL_NODES * sizeof(int));
+  for (int n = 0; n < TOTAL_NODES; n++)
+    ports[n] = NODES[n].port_number;
+  peers_init(HOSTNAME, ports, TOTAL_NODES);
+  peers_set_hedge(HEDGE);
+  free(ports);
   cache = (Cache*) malloc(sizeof(Cache));
-  init_cache(cache, MAX_OBJECT_SIZE);
-  sem_init(&mutex, 0, 1);
-  sem_init(&w, 0, 1);
+  init_cache(cache, MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+  results = (Cache*) malloc(sizeof(Cache));
+  init_cache(results, MAX_RESULT_CACHE_SIZE, MAX_RESULT_SIZE);
 
   node_serve();
 
@@ -345,42 +1040,128 @@ int get_listenfd(int *start_port) {
   return -1;
 }
 
+/* Everything a parent thread needs to serve one node's partition request. */
+typedef struct digest_args {
+  database *db;
+  partition_plan *plan;
+  char *db_path;  // absolute path of the database file
+  int db_fd;      // the database file, read only, for sendfile
+  int connfd;
+} digest_args;
+
+/** @brief Sends length bytes of the database file, starting at offset, to
+ *         connfd straight from the page cache. sendfile may send less than
+ *         asked for, so it is called until everything has been sent.
+ *  @return 0 on success, -1 on error.
+ */
+static int send_partition(int connfd, int db_fd, off_t offset, size_t length) {
+  ssize_t n;
+  while (length > 0) {
+    if ((n = sendfile(connfd, db_fd, &offset, length)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0) // the file is shorter than expected
+      return -1;
+    length -= n;
+  }
+  return 0;
+}
+
+/** @brief Sends a routing table to a node: the number of bounds on a line of
+ *         its own, then each bound on its own line.
+ *  @return 0 on success, -1 on error.
+ */
+static int send_routes(int connfd, routing_table *routes) {
+  char line[MAXLINE];
+  snprintf(line, MAXLINE, "%d\n", routes->nbounds);
+  if (rio_writen(connfd, line, strlen(line)) < 0)
+    return -1;
+  for (int i = 0; i < routes->nbounds; i++) {
+    snprintf(line, MAXLINE, "%s\n", routes->bounds[i]);
+    if (rio_writen(connfd, line, strlen(line)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 /** @brief  Called by the parent to handle a single request from a node for its
  *          partition of the database. 
  *
  *  @param  db The database that will be partitioned. 
+ *  @param  plan How the database is split between the nodes.
+ *  @param  db_path Absolute path of the database file. Nodes use it to find
+ *          the index of the database, and to map their partition themselves.
+ *  @param  db_fd The database file, open for reading. The partition is sent
+ *          from it with sendfile.
  *  @param  connfd The connected file descriptor to read the request (a node id) 
  *          from. The partition of the database is written back in response.
  *  @return If there is an error in the request returns -1. Otherwise returns 0.
 */
-int parent_handle_request(database *db, int connfd) {
+int parent_handle_request(database *db, partition_plan *plan, char *db_path, int db_fd, int connfd) {
   char request[REQUESTLINELEN];
-  char responseline[REQUESTLINELEN];
+  char responseline[MAXLINE];
   char *response;
-  int node_id;
+  int node_id = -1, p;
   ssize_t rl;
-  size_t partition_size = 0;
-  if ((rl = read(connfd, request, REQUESTLINELEN)) < 0) {
+  size_t partition_size = 0, total = 0;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((rl = read(connfd, request, REQUESTLINELEN - 1)) < 0) {
     fprintf(stderr, "parent_handle_request read error: %s\n", strerror(errno));
     return -1;
   }
+  request[rl] = '\0';
   sscanf(request, "%d", &node_id);
   if ((node_id < 0) || (node_id >= TOTAL_NODES)) {
     response = "Invalid Request.\n";
-    partition_size = strlen(response);
-  } else {
-    response = get_partition(db, TOTAL_NODES, node_id, &partition_size);
+    if (rio_writen(connfd, response, strlen(response)) < 0)
+      fprintf(stderr, "parent_handle_request write error: %s\n", strerror(errno));
+    return -1;
   }
-  snprintf(responseline, REQUESTLINELEN, "%lu\n", partition_size);
-  rl = write(connfd, responseline, strlen(responseline));
-  rl = write(connfd, response, partition_size);
+
+  snprintf(responseline, MAXLINE, "%d %d %s\n", db->format, REPLICAS, db_path);
+  if (rio_writen(connfd, responseline, strlen(responseline)) < 0
+      || send_routes(connfd, &plan->routes) < 0) {
+    fprintf(stderr, "NODE %d partition write error: %s\n", node_id, strerror(errno));
+    return -1;
+  }
+  // the node holds partition p if it is one of the REPLICAS nodes from p on
+  for (int r = 0; r < REPLICAS; r++) {
+    p = (node_id - r + TOTAL_NODES) % TOTAL_NODES;
+    response = get_partition(plan, p, &partition_size);
+    snprintf(responseline, MAXLINE, "%d %lu %lu\n", p, partition_size,
+             (size_t) (response - db->map_ptr));
+    if (rio_writen(connfd, responseline, strlen(responseline)) < 0
+        || (!MMAP_PARTITIONS
+            && send_partition(connfd, db_fd, response - db->map_ptr, partition_size) < 0)) {
+      fprintf(stderr, "NODE %d partition write error: %s\n", node_id, strerror(errno));
+      return -1;
+    }
+    total += partition_size;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr, "NODE %d partition: %zu bytes %s in %.3f ms\n", node_id, total,
+          MMAP_PARTITIONS ? "mapped" : "sent",
+          (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
   return 0;
 }
 
+/** @brief Thread routine that serves one node's partition request. */
+static void *parent_thread(void *vargp) {
+  digest_args *args = (digest_args *) vargp;
+  parent_handle_request(args->db, args->plan, args->db_path, args->db_fd, args->connfd);
+  Close(args->connfd);
+  return NULL;
+}
+
 /** Called by the parent process to load in the database, and wait for the child
  *  nodes it created to send a message requesting their portion of the database.
- *  After it has received the same number of requests as nodes, it unmaps the 
- *  database. 
+ *  Each request is served by its own thread, so all nodes receive their
+ *  partitions at the same time. After it has served the same number of
+ *  requests as nodes, it unmaps the database. 
  *
  *  @param db_path path to the database file being loaded in. It is assumed that
  *         the entries contained in this file are already sorted in alphabetical
@@ -389,19 +1170,44 @@ int parent_handle_request(database *db, int connfd) {
 void parent_serve(char *db_path, int parent_connfd) {
   // The parent doesn't need to create/populate the hash table.
   database *db = load_database(db_path);
+  partition_plan *plan = plan_partitions(db, TOTAL_NODES);
+  char abs_path[PATH_MAX];
   struct sockaddr_storage clientaddr;
   socklen_t clientlen = sizeof(clientaddr);
-  int connfd = 0;
+  pthread_t *tids = Calloc(TOTAL_NODES, sizeof(pthread_t));
+  digest_args *args = Calloc(TOTAL_NODES, sizeof(digest_args));
+  int db_fd;
   int requests = 0;
 
+  if (realpath(db_path, abs_path) == NULL) {
+    fprintf(stderr, "realpath error: %s\n", strerror(errno));
+    exit(1);
+  }
+  db_fd = Open(abs_path, O_RDONLY, 0);
   while (requests < TOTAL_NODES) {
-    connfd = accept(parent_connfd, (SA *)&clientaddr, &clientlen);
-    parent_handle_request(db, connfd);
-    Close(connfd);
+    args[requests].db = db;
+    args[requests].plan = plan;
+    args[requests].db_path = abs_path;
+    args[requests].db_fd = db_fd;
+    if ((args[requests].connfd = accept(parent_connfd, (SA *)&clientaddr, &clientlen)) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "accept error: %s\n", strerror(errno));
+      break;
+    }
+    Pthread_create(&tids[requests], NULL, parent_thread, &args[requests]);
     requests++;
   }
+  for (int i = 0; i < requests; i++)
+    Pthread_join(tids[i], NULL);
   // Parent has now finished it's job.
-  Munmap(db->m_ptr, db->db_size);
+  Close(db_fd);
+  Munmap(db->map_ptr, db->map_size);
+  free(plan->starts);
+  free(plan->routes.bounds);
+  free(plan);
+  free(tids);
+  free(args);
 }
 
 /** @brief Called after the parent has finished sending each node its partition 
@@ -431,10 +1237,28 @@ int main(int argc, char const *argv[]) {
   int n_connfd;      
   pid_t pid;
   
-  if (argc != 4) {
-    fprintf(stderr, "usage: %s [num_nodes] [starting_port] [name_of_file]\n", argv[0]);
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s [num_nodes] [starting_port] [name_of_file] [--mmap] [--index=hash|mph] [--prerender] [--replicas=R] [--hedge=percentile]\n", argv[0]);
     exit(1);
   }
+  for (int i = 4; i < argc; i++) {
+    if (strcmp(argv[i], "--mmap") == 0) {
+      MMAP_PARTITIONS = 1;
+    } else if (strcmp(argv[i], "--index=mph") == 0) {
+      MPH_INDEX = 1;
+    } else if (strcmp(argv[i], "--index=hash") == 0) {
+      MPH_INDEX = 0;
+    } else if (strcmp(argv[i], "--prerender") == 0) {
+      PRERENDER = 1;
+    } else if (sscanf(argv[i], "--replicas=%d", &REPLICAS) == 1) {
+      continue;
+    } else if (sscanf(argv[i], "--hedge=%lf", &HEDGE) == 1 && HEDGE >= 0 && HEDGE < 100) {
+      continue;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
   
   sscanf(argv[1], "%d", &TOTAL_NODES);
   sscanf(argv[2], "%d", &start_port);
@@ -442,6 +1266,9 @@ int main(int argc, char const *argv[]) {
   if (TOTAL_NODES < 1 || (TOTAL_NODES > 8)) {
     fprintf(stderr, "Invalid node number given.\n");
     exit(1);
+  } else if (REPLICAS < 1 || REPLICAS > TOTAL_NODES) {
+    fprintf(stderr, "Invalid number of replicas given.\n");
+    exit(1);
   } else if ((start_port < 1024) || start_port >= (MAX_PORTNUM - TOTAL_NODES)) {
     fprintf(stderr, "Invalid starting port given.\n");
     exit(1);
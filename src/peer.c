@@ -0,0 +1,485 @@
+#include "csapp/csapp.h"
+#include "peer.h"
+#include "utils.h"
+#include <netinet/tcp.h>
+#include <time.h>
+
+static peer *peers = NULL;
+static int num_peers = 0;
+
+// Recent response times of successful calls, in microseconds, bucketed by
+// latency_bucket. Protected by latency_lock.
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned latency_counts[LATENCY_BUCKETS];
+static unsigned latency_total = 0;
+// Percentile of the response times used as the hedging delay, 0 to disable
+static double hedge_percentile = HEDGE_PERCENTILE;
+
+typedef struct reader_args {
+  peer *p;
+  int fd;
+  unsigned gen;
+} reader_args;
+
+/** @brief Writes a frame header for a frame with the given op, request id and
+ *         payload length into buf, which must hold PEER_HDR_LEN bytes.
+ */
+void peer_encode_hdr(char *buf, int op, uint32_t id, uint32_t len) {
+  uint32_t nid = htonl(id), nlen = htonl(len);
+  buf[0] = (char) PEER_MAGIC;
+  buf[1] = (char) op;
+  buf[2] = buf[3] = 0;
+  memcpy(buf + 4, &nid, sizeof(nid));
+  memcpy(buf + 8, &nlen, sizeof(nlen));
+}
+
+/** @brief Decodes the frame header at the start of buf.
+ *  @return PEER_HDR_LEN if a whole header was decoded into h, or 0 if buf is
+ *          too short to hold one.
+ */
+size_t peer_decode_hdr(const char *buf, size_t len, peer_hdr *h) {
+  uint32_t nid, nlen;
+  if (len < PEER_HDR_LEN)
+    return 0;
+  memcpy(&nid, buf + 4, sizeof(nid));
+  memcpy(&nlen, buf + 8, sizeof(nlen));
+  h->op = (unsigned char) buf[1];
+  h->id = ntohl(nid);
+  h->len = ntohl(nlen);
+  return PEER_HDR_LEN;
+}
+
+/** @brief Resolves the address of every peer node once, so that forwarding a
+ *         request never has to call getaddrinfo. Connections are opened lazily
+ *         on the first request to each peer.
+ *
+ *  @param hostname host all nodes are listening on
+ *  @param ports port number of each node, indexed by node id
+ *  @param n number of nodes
+ */
+void peers_init(char *hostname, int *ports, int n) {
+  struct addrinfo hints;
+  char port_name[PORT_STRLEN];
+  int rc;
+
+  peers = Calloc(n, sizeof(peer));
+  num_peers = n;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  for (int i = 0; i < n; i++) {
+    port_number_to_str(ports[i], port_name);
+    if ((rc = getaddrinfo(hostname, port_name, &hints, &peers[i].addrs)) != 0)
+      gai_error(rc, "getaddrinfo error");
+    peers[i].fd = -1;
+    pthread_mutex_init(&peers[i].lock, NULL);
+    pthread_mutex_init(&peers[i].wlock, NULL);
+  }
+}
+
+/** @brief Removes and returns the pending call with the given id, or NULL if
+ *         there is none. Must be called with p->lock held.
+ */
+static pending_call *take_pending(peer *p, uint32_t id) {
+  pending_call **pp = &p->pending[id % PEER_PENDING_BUCKETS];
+  for (; *pp; pp = &(*pp)->next) {
+    if ((*pp)->id == id) {
+      pending_call *call = *pp;
+      *pp = call->next;
+      return call;
+    }
+  }
+  return NULL;
+}
+
+/** @brief Completes a call that has been removed from its peer's pending
+ *         table and wakes up the thread waiting for it. Must be called with
+ *         the peer's lock held, so that once a call is no longer pending its
+ *         owner can take that lock to be sure it is complete.
+ */
+static void complete_call(pending_call *call, int done) {
+  pthread_mutex_lock(&call->waiter->lock);
+  call->done = done;
+  pthread_cond_broadcast(&call->waiter->cond);
+  pthread_mutex_unlock(&call->waiter->lock);
+}
+
+/** @brief Fails every call still waiting on connection gen. Must be called
+ *         with p->lock held.
+ */
+static void fail_pending(peer *p, unsigned gen) {
+  for (int b = 0; b < PEER_PENDING_BUCKETS; b++) {
+    pending_call **pp = &p->pending[b];
+    while (*pp) {
+      pending_call *call = *pp;
+      if (call->gen == gen) {
+        *pp = call->next;
+        complete_call(call, -1);
+      } else {
+        pp = &call->next;
+      }
+    }
+  }
+}
+
+/** @brief Returns the histogram bucket of a response time: four buckets for
+ *         every power of two.
+ */
+static int latency_bucket(uint64_t us) {
+  int msb;
+  if (us < 4)
+    return us;
+  msb = 63 - __builtin_clzll(us);
+  return MIN(msb * 4 + (int) ((us >> (msb - 2)) & 3), LATENCY_BUCKETS - 1);
+}
+
+/** @brief Returns the largest response time that falls in a bucket. */
+static uint64_t latency_bucket_max(int b) {
+  if (b < 4)
+    return b;
+  return ((uint64_t) (4 + b % 4 + 1) << (b / 4 - 2)) - 1;
+}
+
+/** @brief Records the response time of a call that was answered. */
+static void record_latency(const struct timespec *sent) {
+  struct timespec now;
+  int64_t us;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  us = (now.tv_sec - sent->tv_sec) * 1000000 + (now.tv_nsec - sent->tv_nsec) / 1000;
+  pthread_mutex_lock(&latency_lock);
+  latency_counts[latency_bucket(us > 0 ? us : 0)]++;
+  if (++latency_total >= HEDGE_WINDOW) {
+    latency_total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      latency_counts[b] /= 2;
+      latency_total += latency_counts[b];
+    }
+  }
+  pthread_mutex_unlock(&latency_lock);
+}
+
+/** @brief Returns how long to wait for an answer before hedging a call, in
+ *         microseconds, or -1 if hedging is disabled.
+ */
+static int64_t hedge_delay(void) {
+  unsigned rank, seen = 0;
+  int64_t delay = HEDGE_DEFAULT_US;
+
+  if (hedge_percentile <= 0)
+    return -1;
+  pthread_mutex_lock(&latency_lock);
+  if (latency_total >= HEDGE_MIN_SAMPLES) {
+    rank = (unsigned) (latency_total * hedge_percentile / 100.0);
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      seen += latency_counts[b];
+      if (seen > rank || b == LATENCY_BUCKETS - 1) {
+        delay = latency_bucket_max(b);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&latency_lock);
+  return delay;
+}
+
+/** @brief Sets the percentile of recent response times after which calls to
+ *         replicas are hedged. 0 disables hedging.
+ */
+void peers_set_hedge(double percentile) {
+  hedge_percentile = percentile;
+}
+
+/** @brief Reads response frames from one connection to a peer and hands each
+ *         one to the call waiting for its id. When the connection fails, every
+ *         call still waiting on it is failed and the peer is marked as
+ *         disconnected so that the next request reconnects.
+ */
+static void *peer_reader(void *vargp) {
+  reader_args args = *(reader_args *) vargp;
+  peer *p = args.p;
+  char hdr_buf[PEER_HDR_LEN];
+  pending_call *call;
+  peer_hdr hdr;
+  char *payload;
+  rio_t rio;
+
+  free(vargp);
+  Pthread_detach(pthread_self());
+  rio_readinitb(&rio, args.fd);
+  while (rio_readnb(&rio, hdr_buf, PEER_HDR_LEN) == PEER_HDR_LEN) {
+    peer_decode_hdr(hdr_buf, PEER_HDR_LEN, &hdr);
+    if ((unsigned char) hdr_buf[0] != PEER_MAGIC)
+      break;
+    payload = Malloc(hdr.len + 1);
+    if (rio_readnb(&rio, payload, hdr.len) != (ssize_t) hdr.len) {
+      free(payload);
+      break;
+    }
+    payload[hdr.len] = '\0';
+
+    // a call that is no longer pending was cancelled, and its answer is
+    // dropped
+    pthread_mutex_lock(&p->lock);
+    if ((call = take_pending(p, hdr.id)) != NULL) {
+      if (hdr.op == PEER_UNAVAILABLE) {
+        complete_call(call, -1);
+      } else {
+        call->resp = payload;
+        call->resp_len = hdr.len;
+        complete_call(call, 1);
+        payload = NULL;
+      }
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(payload);
+  }
+
+  // Writers hold wlock while using the descriptor, so it is only closed once
+  // no writer can still see it.
+  pthread_mutex_lock(&p->wlock);
+  pthread_mutex_lock(&p->lock);
+  if (p->gen == args.gen)
+    p->fd = -1;
+  fail_pending(p, args.gen);
+  pthread_mutex_unlock(&p->lock);
+  close(args.fd);
+  pthread_mutex_unlock(&p->wlock);
+  return NULL;
+}
+
+/** @brief Opens a connection to a peer using its cached addresses and starts
+ *         its reader thread. Must be called with p->wlock and p->lock held.
+ *  @return 0 on success, -1 if the peer cannot be reached.
+ */
+static int peer_connect(peer *p) {
+  struct addrinfo *a;
+  reader_args *args;
+  pthread_t tid;
+  int fd, one = 1;
+
+  for (a = p->addrs; a; a = a->ai_next) {
+    if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+      break;
+    close(fd);
+  }
+  if (!a)
+    return -1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  p->fd = fd;
+  p->gen++;
+  args = Malloc(sizeof(reader_args));
+  args->p = p;
+  args->fd = fd;
+  args->gen = p->gen;
+  Pthread_create(&tid, NULL, peer_reader, args);
+  return 0;
+}
+
+/** @brief Sends one request to a peer over its shared connection without
+ *         waiting for the response, which is delivered to call by the peer's
+ *         reader thread.
+ *  @return 0 if the request was sent, or -1 if the peer cannot be reached.
+ */
+static int call_start(peer *p, pending_call *call, call_waiter *waiter, int op,
+                      const char *payload, uint32_t len) {
+  char hdr[PEER_HDR_LEN];
+  pending_call **bucket;
+  int fd;
+
+  pthread_mutex_lock(&p->wlock);
+  pthread_mutex_lock(&p->lock);
+  if (p->fd < 0 && peer_connect(p) < 0) {
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->wlock);
+    return -1;
+  }
+  fd = p->fd;
+  call->id = p->next_id++;
+  call->gen = p->gen;
+  call->done = 0;
+  call->resp = NULL;
+  call->waiter = waiter;
+  clock_gettime(CLOCK_MONOTONIC, &call->sent);
+  bucket = &p->pending[call->id % PEER_PENDING_BUCKETS];
+  call->next = *bucket;
+  *bucket = call;
+  pthread_mutex_unlock(&p->lock);
+
+  // The reader only needs p->lock to deliver responses, so it keeps draining
+  // the connection even while this write blocks.
+  peer_encode_hdr(hdr, op, call->id, len);
+  if (rio_writen(fd, hdr, PEER_HDR_LEN) != PEER_HDR_LEN
+      || rio_writen(fd, (void *) payload, len) != (ssize_t) len) {
+    // the reader sees the shutdown, fails the calls and disconnects
+    shutdown(fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&p->wlock);
+  return 0;
+}
+
+/** @brief Gives up on a call that may still be pending. If it has already
+ *         been answered its response is freed.
+ */
+static void call_cancel(peer *p, pending_call *call) {
+  pthread_mutex_lock(&p->lock);
+  // a call that is no longer pending has been completed under this lock
+  take_pending(p, call->id);
+  pthread_mutex_unlock(&p->lock);
+  free(call->resp);
+  call->resp = NULL;
+}
+
+/** @brief Sets ts to the CLOCK_REALTIME time us microseconds from now. */
+static void deadline_after(struct timespec *ts, int64_t us) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += (ts->tv_nsec + us * 1000) / 1000000000;
+  ts->tv_nsec = (ts->tv_nsec + us * 1000) % 1000000000;
+}
+
+/** @brief Returns whether time a is earlier than time b. */
+static int ts_before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/** @brief Sends a request that any of several peers can answer, starting with
+ *         ids[0]. If no answer has arrived after the hedging delay (see
+ *         hedge_delay) the request is also sent to the next peer, once; a
+ *         peer that cannot be reached, or has not answered within
+ *         PEER_CALL_TIMEOUT_US, is replaced by the next one straight away.
+ *         The first answer wins, and the calls still in flight are
+ *         cancelled: their answers are dropped when they arrive.
+ *
+ *  @param ids ids of the nodes that can answer the request, in order of
+ *         preference
+ *  @param n number of nodes in ids
+ *  @return the response payload (NUL terminated), which the caller must free,
+ *          or NULL if none of the peers answered in time.
+ */
+char *peer_call_hedged(const int *ids, int n, int op, const char *payload, uint32_t len,
+                       uint32_t *resp_len) {
+  pending_call calls[n];
+  int state[n];         // 0 not sent, 1 in flight, 2 finished
+  struct timespec expires[n];
+  call_waiter waiter;
+  struct timespec deadline, now, wake;
+  int64_t delay = n > 1 ? hedge_delay() : -1;
+  int next = 0, active = 0, hedged = 0, winner = -1, timed_out, expired;
+  char *resp = NULL;
+
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_cond_init(&waiter.cond, NULL);
+  memset(state, 0, sizeof(state));
+  while (winner < 0) {
+    // keep one call in flight, plus the hedge once the delay has passed
+    while ((active == 0 || (hedged == 1 && active < 2)) && next < n) {
+      __atomic_add_fetch(&peers[ids[next]].outstanding, 1, __ATOMIC_RELAXED);
+      if (call_start(&peers[ids[next]], &calls[next], &waiter, op, payload, len) == 0) {
+        state[next] = 1;
+        active++;
+        deadline_after(&expires[next], PEER_CALL_TIMEOUT_US);
+        if (hedged == 0 && delay >= 0)
+          deadline_after(&deadline, delay);
+      } else {
+        __atomic_sub_fetch(&peers[ids[next]].outstanding, 1, __ATOMIC_RELAXED);
+      }
+      next++;
+    }
+    if (hedged == 1)
+      hedged = 2;
+    if (active == 0)
+      break;
+
+    timed_out = expired = 0;
+    pthread_mutex_lock(&waiter.lock);
+    for (;;) {
+      int failed = 0, hedging = hedged == 0 && delay >= 0 && next < n, bounded = hedging;
+      for (int i = 0; i < next; i++) {
+        if (state[i] == 1 && calls[i].done == 1 && winner < 0)
+          winner = i;
+        else if (state[i] == 1 && calls[i].done == -1) {
+          state[i] = 2;
+          active--;
+          failed = 1;
+        }
+      }
+      if (winner >= 0 || failed)
+        break;
+
+      // sleep until the hedge is due or the next call times out, whichever
+      // comes first. There is always a call in flight here.
+      clock_gettime(CLOCK_REALTIME, &now);
+      timed_out = hedging && !ts_before(&now, &deadline);
+      if (hedging)
+        wake = deadline;
+      for (int i = 0; i < next; i++) {
+        if (state[i] != 1)
+          continue;
+        if (!ts_before(&now, &expires[i])) {
+          expired = 1;
+        } else if (!bounded || ts_before(&expires[i], &wake)) {
+          wake = expires[i];
+          bounded = 1;
+        }
+      }
+      if (timed_out || expired)
+        break;
+      pthread_cond_timedwait(&waiter.cond, &waiter.lock, &wake);
+    }
+    pthread_mutex_unlock(&waiter.lock);
+    if (timed_out && hedged == 0)
+      hedged = 1;
+
+    // once cancelled a call can no longer be completed, so it is failed for
+    // good
+    for (int i = 0; expired && winner < 0 && i < next; i++) {
+      if (state[i] == 1 && !ts_before(&now, &expires[i])) {
+        call_cancel(&peers[ids[i]], &calls[i]);
+        state[i] = 2;
+        active--;
+      }
+    }
+  }
+
+  for (int i = 0; i < next; i++) {
+    if (state[i] == 0)
+      continue;
+    if (i == winner) {
+      record_latency(&calls[i].sent);
+      resp = calls[i].resp;
+      *resp_len = calls[i].resp_len;
+    } else if (state[i] == 1) {
+      call_cancel(&peers[ids[i]], &calls[i]);
+    }
+    __atomic_sub_fetch(&peers[ids[i]].outstanding, 1, __ATOMIC_RELAXED);
+  }
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.lock);
+  return resp;
+}
+
+/** @brief Picks which of several peers that can answer a request to send it
+ *         to, by the power of two choices: of two peers chosen at random, the
+ *         one with fewer calls in flight from this node.
+ *
+ *  @param ids ids of the candidate peers
+ *  @param n number of candidates
+ *  @return the index in ids of the chosen peer
+ */
+int peer_pick(const int *ids, int n) {
+  static __thread unsigned int seed = 0;
+  int a, b;
+
+  if (n <= 1)
+    return 0;
+  if (seed == 0)
+    seed = (unsigned int) pthread_self() ^ (unsigned int) getpid();
+  a = rand_r(&seed) % n;
+  b = (a + 1 + rand_r(&seed) % (n - 1)) % n;
+  if (__atomic_load_n(&peers[ids[b]].outstanding, __ATOMIC_RELAXED)
+      < __atomic_load_n(&peers[ids[a]].outstanding, __ATOMIC_RELAXED))
+    return b;
+  return a;
+}
@@ -0,0 +1,87 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include "csapp/csapp.h"
+#include <stdint.h>
+
+/* Inter-node frames. Every frame starts with a PEER_HDR_LEN byte header:
+ *   magic (1) | op (1) | reserved (2) | request id (4) | payload length (4)
+ * with multi-byte fields in network byte order. A client request line never
+ * starts with PEER_MAGIC, so a node can tell frames and lines apart by their
+ * first byte. */
+#define PEER_MAGIC 0xA5
+#define PEER_HDR_LEN 12
+
+// Buckets in each peer's table of in-flight requests.
+#define PEER_PENDING_BUCKETS 64
+// A call not answered within this many microseconds is given up on, as if its
+// peer could not be reached
+#define PEER_CALL_TIMEOUT_US 2000000
+
+// Hedging: a request to one of several replicas is sent again to the next one
+// if it has not been answered within this percentile of recent response times.
+#define HEDGE_PERCENTILE 95.0
+// Delay used until HEDGE_MIN_SAMPLES response times have been seen
+#define HEDGE_DEFAULT_US 5000
+#define HEDGE_MIN_SAMPLES 32
+// Counts are halved once this many response times have been recorded, so the
+// delay follows recent behaviour
+#define HEDGE_WINDOW 1024
+// Response times are kept in a histogram with four buckets per power of two
+#define LATENCY_BUCKETS 160
+
+enum peer_op {
+  PEER_LOOKUP = 1, /* payload: key. reply: packed value array, empty if not found */
+  PEER_FILTER = 2, /* payload: partition id. reply: packed Bloom filter of its
+                      keys */
+  PEER_UNAVAILABLE = 3, /* reply only: this node does not hold the partition
+                           asked about, so the call fails and the caller moves
+                           on to another replica */
+};
+
+typedef struct peer_hdr {
+  int op;
+  uint32_t id;
+  uint32_t len;
+} peer_hdr;
+
+/* What a thread waiting for one or more calls sleeps on. */
+typedef struct call_waiter {
+  pthread_mutex_t lock;   /* protects the done fields of its calls */
+  pthread_cond_t cond;
+} call_waiter;
+
+/* A request waiting for its response. */
+typedef struct pending_call {
+  uint32_t id;
+  unsigned gen;           /* connection the request was sent on */
+  int done;               /* 1 when answered, -1 if the connection failed */
+  char *resp;             /* response payload, NUL terminated */
+  uint32_t resp_len;
+  struct timespec sent;
+  call_waiter *waiter;
+  struct pending_call *next; /* chain in the pending table */
+} pending_call;
+
+/* A single multiplexed connection to a peer node, shared by all threads. */
+typedef struct peer {
+  struct addrinfo *addrs; /* resolved once by peers_init */
+  int fd;                 /* -1 while disconnected */
+  unsigned gen;           /* incremented on every reconnect */
+  uint32_t next_id;
+  int outstanding;        /* calls in flight, updated atomically */
+  pending_call *pending[PEER_PENDING_BUCKETS];
+  pthread_mutex_t lock;   /* protects everything above; taken before a waiter's lock */
+  pthread_mutex_t wlock;  /* serialises writes to fd; taken before lock */
+} peer;
+
+void peers_init(char *hostname, int *ports, int n);
+int peer_pick(const int *ids, int n);
+char *peer_call_hedged(const int *ids, int n, int op, const char *payload, uint32_t len,
+                       uint32_t *resp_len);
+void peers_set_hedge(double percentile);
+
+void peer_encode_hdr(char *buf, int op, uint32_t id, uint32_t len);
+size_t peer_decode_hdr(const char *buf, size_t len, peer_hdr *h);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,479 @@
+#include "postings.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/** @brief Linear merge of two sorted lists. Best when the lists have similar
+ *         lengths.
+ */
+int intersect_merge(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst) {
+  int i = 0, j = 0, k = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (a[i] > b[j]) {
+      j++;
+    } else {
+      if (k == 0 || dst[k-1] != a[i])
+        dst[k++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return k;
+}
+
+/** @brief Returns the index of the first element of b[lo..nb) that is not less
+ *         than v, probing 1, 2, 4, ... elements ahead before binary searching.
+ */
+static int gallop(const unsigned int *b, int lo, int nb, unsigned int v) {
+  int step = 1, hi = lo;
+  while (hi < nb && b[hi] < v) {
+    lo = hi + 1;
+    hi += step;
+    step <<= 1;
+  }
+  if (hi > nb)
+    hi = nb;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (b[mid] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/** @brief Looks up every element of the short list a in the long list b with
+ *         exponential search, so the cost is O(na log(nb/na)) rather than
+ *         O(na + nb).
+ */
+int intersect_gallop(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst) {
+  int i, j = 0, k = 0;
+  for (i = 0; i < na && j < nb; i++) {
+    if (i > 0 && a[i] == a[i-1]) // skip duplicates in a
+      continue;
+    j = gallop(b, j, nb, a[i]);
+    if (j < nb && b[j] == a[i])
+      dst[k++] = a[i];
+  }
+  return k;
+}
+
+#ifdef HAVE_X86_SIMD
+/* The block kernels below keep b[j..j+W) as the block that may hold a[i]:
+ * whole blocks that end below a[i] are skipped, then a[i] is compared against
+ * all W lanes at once. Everything before j is less than a[i], so a[i] is in b
+ * if and only if it is in the current block. */
+
+__attribute__((target("avx2")))
+static int intersect_avx2(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst) {
+  int i, j = 0, k = 0;
+  for (i = 0; i < na && j + 8 <= nb; i++) {
+    if (i > 0 && a[i] == a[i-1])
+      continue;
+    while (j + 8 <= nb && b[j+7] < a[i])
+      j += 8;
+    if (j + 8 > nb)
+      break;
+    __m256i block = _mm256_loadu_si256((const __m256i *) (b + j));
+    __m256i eq = _mm256_cmpeq_epi32(block, _mm256_set1_epi32((int) a[i]));
+    if (_mm256_movemask_epi8(eq))
+      dst[k++] = a[i];
+  }
+  for (; i < na; i++) { // the tail of b is shorter than a block
+    if (i > 0 && a[i] == a[i-1])
+      continue;
+    j = gallop(b, j, nb, a[i]);
+    if (j == nb)
+      break;
+    if (b[j] == a[i])
+      dst[k++] = a[i];
+  }
+  return k;
+}
+
+static int intersect_sse2(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst) {
+  int i, j = 0, k = 0;
+  for (i = 0; i < na && j + 4 <= nb; i++) {
+    if (i > 0 && a[i] == a[i-1])
+      continue;
+    while (j + 4 <= nb && b[j+3] < a[i])
+      j += 4;
+    if (j + 4 > nb)
+      break;
+    __m128i block = _mm_loadu_si128((const __m128i *) (b + j));
+    __m128i eq = _mm_cmpeq_epi32(block, _mm_set1_epi32((int) a[i]));
+    if (_mm_movemask_epi8(eq))
+      dst[k++] = a[i];
+  }
+  for (; i < na; i++) {
+    if (i > 0 && a[i] == a[i-1])
+      continue;
+    j = gallop(b, j, nb, a[i]);
+    if (j == nb)
+      break;
+    if (b[j] == a[i])
+      dst[k++] = a[i];
+  }
+  return k;
+}
+#endif
+
+static intersect_fn simd_kernel = intersect_merge;
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+/** @brief Picks the widest block kernel the CPU supports. */
+static void pick_simd_kernel(void) {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    simd_kernel = intersect_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    simd_kernel = intersect_sse2;
+#endif
+}
+
+/** @brief Block-compare intersection using the widest SIMD instructions the
+ *         CPU supports, falling back to a linear merge elsewhere.
+ */
+int intersect_simd(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst) {
+  pthread_once(&simd_once, pick_simd_kernel);
+  return simd_kernel(a, na, b, nb, dst);
+}
+
+/** @brief  Calculates the intersection of two sorted value arrays, removing all
+ *          duplicate values. The kernel is chosen from the list lengths:
+ *          galloping when one list is much longer than the other, the SIMD
+ *          block kernel for long lists of similar length, and a linear merge
+ *          for short ones. All kernels produce the same output.
+ *
+ *  @return A pointer to a newly allocated value_array that contains the
+ *          intersection, or NULL if either va_1/va_2 is NULL, or malloc fails.
+ */
+value_array *postings_intersect(value_array *va_1, value_array *va_2) {
+  value_array *dst, *a, *b;
+  intersect_fn kernel;
+
+  if ((va_1 == NULL) || (va_2 == NULL))
+    return NULL;
+  a = va_1->len <= va_2->len ? va_1 : va_2; // a is the shorter list
+  b = a == va_1 ? va_2 : va_1;
+
+  dst = malloc(sizeof(value_array) + (a->len * sizeof(unsigned int)));
+  if (dst == NULL)
+    return NULL;
+  if ((long) a->len * GALLOP_RATIO < b->len)
+    kernel = intersect_gallop;
+  else if (a->len >= SIMD_MIN_LEN)
+    kernel = intersect_simd;
+  else
+    kernel = intersect_merge;
+  dst->len = kernel(a->arr, a->len, b->arr, b->len, dst->arr);
+  return dst;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, uint32_t *v) {
+  uint32_t x = 0;
+  int shift = 0;
+  do {
+    x |= (uint32_t) (*p & 0x7f) << shift;
+    shift += 7;
+  } while (*p++ & 0x80);
+  *v = x;
+  return p;
+}
+
+/** @brief  Returns the number of bytes block_postings_encode needs for n values,
+ *          not counting the padding that aligns the next entry.
+ */
+size_t block_postings_size(const unsigned int *values, int n) {
+  unsigned char tmp[5];
+  size_t nblocks = (n + POSTING_BLOCK - 1) / POSTING_BLOCK;
+  size_t size = sizeof(block_postings) + 2 * (nblocks > 1 ? nblocks - 1 : 0) * sizeof(uint32_t);
+  for (int i = 0; i < n; i++)
+    if (i == 0 || i % POSTING_BLOCK != 0)
+      size += put_varint(tmp, i == 0 ? values[0] : values[i] - values[i-1]) - tmp;
+  return size;
+}
+
+/** @brief  Encodes n sorted values as a block_postings. bp must have room for
+ *          block_postings_size(values, n) bytes. The first value of the first
+ *          block is stored as a gap from zero; the first value of every other
+ *          block is only stored in the skip table.
+ *  @return number of bytes written.
+ */
+size_t block_postings_encode(const unsigned int *values, int n, block_postings *bp) {
+  unsigned char *data, *p;
+  bp->len = n;
+  data = p = (unsigned char *) BLOCK_DATA(bp);
+  for (int i = 0; i < n; i++) {
+    if (i == 0) {
+      p = put_varint(p, values[0]);
+    } else if (i % POSTING_BLOCK == 0) {
+      bp->skips[2 * (i / POSTING_BLOCK - 1)] = values[i];
+      bp->skips[2 * (i / POSTING_BLOCK - 1) + 1] = p - data;
+    } else {
+      p = put_varint(p, values[i] - values[i-1]);
+    }
+  }
+  return (char *) p - (char *) bp;
+}
+
+/** @brief Returns the first value of block b. */
+static unsigned int block_first(const block_postings *bp, uint32_t b) {
+  uint32_t v;
+  if (b > 0)
+    return bp->skips[2 * (b - 1)];
+  get_varint(BLOCK_DATA(bp), &v);
+  return v;
+}
+
+/** @brief Decodes block b of an encoded list into out.
+ *  @return a pointer just past the block's data. The number of values decoded
+ *          is stored in n.
+ */
+static const unsigned char *decode_block(const block_postings *bp, uint32_t b, unsigned int *out, int *n) {
+  const unsigned char *p = BLOCK_DATA(bp);
+  uint32_t gap;
+  *n = MIN(POSTING_BLOCK, (int) (bp->len - b * POSTING_BLOCK));
+  if (b == 0) {
+    p = get_varint(p, &gap);
+    out[0] = gap;
+  } else {
+    p += bp->skips[2 * (b - 1) + 1];
+    out[0] = bp->skips[2 * (b - 1)];
+  }
+  for (int i = 1; i < *n; i++) {
+    p = get_varint(p, &gap);
+    out[i] = out[i-1] + gap;
+  }
+  return p;
+}
+
+/** @brief  Returns a pointer just past the end of an encoded list. */
+const char *block_postings_end(const block_postings *bp) {
+  unsigned int block[POSTING_BLOCK];
+  int n;
+  if (bp->len == 0)
+    return (const char *) BLOCK_DATA(bp);
+  return (const char *) decode_block(bp, BLOCK_COUNT(bp) - 1, block, &n);
+}
+
+/** @brief  Decodes a whole block-compressed posting list.
+ *  @return A pointer to a newly allocated value_array. The caller must free it.
+ */
+value_array *block_postings_decode(const block_postings *bp) {
+  value_array *va = malloc(sizeof(value_array) + bp->len * sizeof(unsigned int));
+  int n;
+  va->len = bp->len;
+  for (uint32_t b = 0; b < BLOCK_COUNT(bp); b++)
+    decode_block(bp, b, va->arr + b * POSTING_BLOCK, &n);
+  return va;
+}
+
+/** @brief  Returns the decoded values of a posting list, decoding it first if
+ *          it is still encoded.
+ */
+value_array *posting_list_values(posting_list *pl) {
+  if (pl->va == NULL && pl->blocks != NULL) {
+    pl->va = block_postings_decode(pl->blocks);
+    pl->owned = 1;
+  }
+  return pl->va;
+}
+
+void posting_list_free(posting_list *pl) {
+  if (pl->owned)
+    free(pl->va);
+  if (pl->release)
+    pl->release(pl->ref);
+  pl->va = NULL;
+  pl->owned = 0;
+  pl->release = NULL;
+}
+
+/** @brief  Intersects a sorted value array with a block-compressed list. The
+ *          block that may hold each value of va is found from the first value
+ *          of every block, and only those blocks are decoded.
+ *
+ *  @return A pointer to a newly allocated value_array that contains the
+ *          intersection, without duplicates.
+ */
+value_array *postings_intersect_blocks(value_array *va, const block_postings *bp) {
+  unsigned int block[POSTING_BLOCK];
+  uint32_t b = 0, nblocks = BLOCK_COUNT(bp), decoded = UINT32_MAX;
+  int n = 0, j = 0;
+  value_array *dst;
+
+  dst = malloc(sizeof(value_array) + va->len * sizeof(unsigned int));
+  dst->len = 0;
+  if (nblocks == 0)
+    return dst;
+  unsigned int first = block_first(bp, 0);
+  for (int i = 0; i < va->len; i++) {
+    unsigned int v = va->arr[i];
+    if ((i > 0 && v == va->arr[i-1]) || v < first)
+      continue;
+    while (b + 1 < nblocks && block_first(bp, b + 1) <= v)
+      b++;
+    if (b != decoded) {
+      decode_block(bp, b, block, &n);
+      decoded = b;
+      j = 0;
+    }
+    j = gallop(block, j, n, v);
+    if (j == n && b + 1 == nblocks)
+      break;
+    if (j < n && block[j] == v)
+      dst->arr[dst->len++] = v;
+  }
+  return dst;
+}
+
+static int cmp_len(const void *x, const void *y) {
+  return ((posting_list *) x)->len - ((posting_list *) y)->len;
+}
+
+/** @brief  Calculates the intersection of n posting lists. The lists are
+ *          intersected shortest first, so the intermediate result shrinks as
+ *          quickly as possible, and evaluation stops as soon as it is empty.
+ *          Only the shortest list is decoded in full; the blocks of the other
+ *          encoded lists are decoded only where the intermediate result may
+ *          match them.
+ *
+ *  @param  lists array of n posting lists. It is reordered by this function.
+ *  @param  n number of lists, at least one
+ *  @return A pointer to a newly allocated value_array that contains the
+ *          intersection, or NULL if malloc fails.
+ */
+value_array *postings_intersect_all(posting_list *lists, int n) {
+  value_array *acc, *next, *first;
+
+  qsort(lists, n, sizeof(posting_list), cmp_len);
+  // intersecting the shortest list with itself copies it without duplicates
+  first = posting_list_values(&lists[0]);
+  acc = postings_intersect(first, first);
+  for (int i = 1; i < n && acc != NULL && acc->len > 0; i++) {
+    if (lists[i].va)
+      next = postings_intersect(acc, lists[i].va);
+    else
+      next = postings_intersect_blocks(acc, lists[i].blocks);
+    free(acc);
+    acc = next;
+  }
+  return acc;
+}
+
+/** @brief Restores the heap property below index i. */
+static void sift_down(merge_cursor *heap, int n, int i) {
+  merge_cursor tmp = heap[i];
+  while (2*i + 1 < n) {
+    int c = 2*i + 1;
+    if (c + 1 < n && heap[c+1].arr[heap[c+1].pos] < heap[c].arr[heap[c].pos])
+      c++;
+    if (tmp.arr[tmp.pos] <= heap[c].arr[heap[c].pos])
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = tmp;
+}
+
+/** @brief Prepares a k-way merge over n sorted value arrays. NULL and empty
+ *         arrays are ignored.
+ */
+void kway_init(kway_merge *m, value_array **lists, int n) {
+  m->heap = malloc((n > 0 ? n : 1) * sizeof(merge_cursor));
+  m->n = 0;
+  m->started = 0;
+  for (int i = 0; i < n; i++) {
+    if (lists[i] == NULL || lists[i]->len == 0)
+      continue;
+    m->heap[m->n].arr = lists[i]->arr;
+    m->heap[m->n].pos = 0;
+    m->heap[m->n].len = lists[i]->len;
+    m->n++;
+  }
+  for (int i = m->n / 2 - 1; i >= 0; i--)
+    sift_down(m->heap, m->n, i);
+}
+
+/** @brief Produces the next distinct value of the merge.
+ *  @return 1 if a value was written to out, 0 once every list is exhausted.
+ */
+int kway_next(kway_merge *m, unsigned int *out) {
+  while (m->n > 0) {
+    merge_cursor *top = &m->heap[0];
+    unsigned int v = top->arr[top->pos];
+    if (++top->pos == top->len)
+      m->heap[0] = m->heap[--m->n];
+    if (m->n > 0)
+      sift_down(m->heap, m->n, 0);
+    if (m->started && v == m->last) // duplicate within or across lists
+      continue;
+    m->started = 1;
+    m->last = v;
+    *out = v;
+    return 1;
+  }
+  return 0;
+}
+
+void kway_free(kway_merge *m) {
+  free(m->heap);
+}
+
+/** @brief Advances a merge over excluded lists up to v.
+ *  @return 1 if v is one of the excluded values.
+ */
+static int excluded(kway_merge *ex, int *has, unsigned int *next, unsigned int v) {
+  while (*has && *next < v)
+    *has = kway_next(ex, next);
+  return *has && *next == v;
+}
+
+/** @brief  Calculates the union (OR) of n sorted value arrays, minus every
+ *          value in the nexclude arrays (AND NOT). Both sides are streamed
+ *          through k-way merges, so no intermediate list is built.
+ *
+ *  @return A pointer to a newly allocated value_array holding the distinct
+ *          values of the result in ascending order.
+ */
+value_array *postings_union_minus(value_array **lists, int n, value_array **exclude, int nexclude) {
+  kway_merge in, ex;
+  unsigned int v, next;
+  long total = 0;
+  int has;
+  value_array *dst;
+
+  for (int i = 0; i < n; i++)
+    total += lists[i] ? lists[i]->len : 0;
+  if ((dst = malloc(sizeof(value_array) + total * sizeof(unsigned int))) == NULL)
+    return NULL;
+  dst->len = 0;
+  kway_init(&in, lists, n);
+  kway_init(&ex, exclude, nexclude);
+  has = kway_next(&ex, &next);
+  while (kway_next(&in, &v))
+    if (!excluded(&ex, &has, &next, v))
+      dst->arr[dst->len++] = v;
+  kway_free(&in);
+  kway_free(&ex);
+  return dst;
+}
@@ -0,0 +1,66 @@
+#ifndef __POSTINGS_H__
+#define __POSTINGS_H__
+
+#include "utils.h"
+
+// Gallop through the longer list once it is this many times the shorter one.
+#define GALLOP_RATIO 32
+// Lists shorter than this are merged with the scalar kernel.
+#define SIMD_MIN_LEN 16
+
+/* Kernel that writes the distinct values common to a and b (both sorted) to
+ * dst and returns how many it wrote. a is the shorter list. */
+typedef int (*intersect_fn)(const unsigned int *a, int na,
+                            const unsigned int *b, int nb, unsigned int *dst);
+
+int intersect_merge(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst);
+int intersect_gallop(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst);
+int intersect_simd(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *dst);
+
+/* A posting list used as an operand of a query. Lists read from a
+ * block-compressed partition stay encoded until their values are needed, and
+ * intersections only decode the blocks they touch. */
+typedef struct posting_list {
+  int len;
+  value_array *va;              /* decoded values, or NULL while encoded */
+  const block_postings *blocks; /* the encoded list while va is NULL */
+  int owned;                    /* va was allocated and must be freed */
+  void *ref;                    /* what va points into, if it is borrowed */
+  void (*release)(void *ref);   /* called on ref by posting_list_free */
+} posting_list;
+
+/* A cursor into one of the lists being merged. */
+typedef struct merge_cursor {
+  const unsigned int *arr;
+  int pos;
+  int len;
+} merge_cursor;
+
+/* Iterates over the distinct values of several sorted lists in ascending order
+ * without materialising their union. The cursors form a binary min-heap keyed
+ * on their current value. */
+typedef struct kway_merge {
+  merge_cursor *heap;
+  int n;            /* number of cursors that are not yet exhausted */
+  int started;
+  unsigned int last;
+} kway_merge;
+
+void kway_init(kway_merge *m, value_array **lists, int n);
+int kway_next(kway_merge *m, unsigned int *out);
+void kway_free(kway_merge *m);
+
+size_t block_postings_size(const unsigned int *values, int n);
+size_t block_postings_encode(const unsigned int *values, int n, block_postings *bp);
+value_array *block_postings_decode(const block_postings *bp);
+const char *block_postings_end(const block_postings *bp);
+
+value_array *posting_list_values(posting_list *pl);
+void posting_list_free(posting_list *pl);
+
+value_array *postings_intersect(value_array *va_1, value_array *va_2);
+value_array *postings_intersect_blocks(value_array *va, const block_postings *bp);
+value_array *postings_intersect_all(posting_list *lists, int n);
+value_array *postings_union_minus(value_array **lists, int n, value_array **exclude, int nexclude);
+
+#endif /* __POSTINGS_H__ */
@@ -0,0 +1,83 @@
+#include "csapp/csapp.h"
+#include "prerender.h"
+
+/** @brief Renders the response line of every entry of a partition into one
+ *         arena. The arena is sized in a first pass over the entries, with
+ *         values_str_len, and filled in a second.
+ *
+ *  @param db the partition
+ *  @return the rendered lines.
+ */
+prerendered *prerender_build(database *db) {
+  prerendered *pr = Calloc(1, sizeof(prerendered));
+  uint32_t n = 0;
+  size_t size = 0, len, key_len;
+  value_array *va;
+  uint64_t hash;
+  char *entry, *p;
+  int owned;
+
+  for (entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry)) {
+    va = get_entry_values(db, entry, &owned);
+    size += strlen(entry) + values_str_len(va->arr, va->len) + 1;
+    if (owned)
+      free(va);
+    n++;
+  }
+  // keep the table at most half full
+  pr->nslots = 1;
+  while (pr->nslots < 2 * n)
+    pr->nslots <<= 1;
+  pr->slots = Calloc(pr->nslots, sizeof(prerender_slot));
+  pr->text = Malloc(size ? size : 1);
+  pr->text_len = size;
+
+  p = pr->text;
+  for (entry = db->m_ptr; entry < DB_END(db); entry = next_entry(db, entry)) {
+    va = get_entry_values(db, entry, &owned);
+    key_len = strlen(entry);
+    memcpy(p, entry, key_len);
+    len = key_len + values_to_str(va->arr, va->len, p + key_len);
+    p[len++] = '\n';
+    if (owned)
+      free(va);
+
+    hash = hash_key(entry, key_len);
+    for (uint32_t i = hash & (pr->nslots - 1); ; i = (i + 1) & (pr->nslots - 1)) {
+      if (pr->slots[i].len == 0) {
+        pr->slots[i].check = hash >> 32;
+        pr->slots[i].len = len;
+        pr->slots[i].off = p - pr->text;
+        break;
+      }
+    }
+    p += len;
+  }
+  return pr;
+}
+
+/** @brief Looks a key up in the rendered lines of a partition.
+ *
+ *  @param db a partition that was rendered by prerender_build
+ *  @param len set to the length of the line, including its newline
+ *  @return the response line of the key, which is not NUL terminated, or NULL
+ *          if the partition has no such key.
+ */
+const char *prerender_find(database *db, const char *key, uint32_t *len) {
+  prerendered *pr = db->rendered;
+  size_t key_len = strlen(key);
+  uint64_t hash = hash_key(key, key_len);
+  const char *line;
+
+  for (uint32_t i = hash & (pr->nslots - 1); pr->slots[i].len != 0; i = (i + 1) & (pr->nslots - 1)) {
+    if (pr->slots[i].check != (uint32_t) (hash >> 32) || pr->slots[i].len <= key_len)
+      continue;
+    // the line starts with its key, followed by a ',' or the newline
+    line = pr->text + pr->slots[i].off;
+    if (memcmp(line, key, key_len) == 0 && (line[key_len] == ',' || line[key_len] == '\n')) {
+      *len = pr->slots[i].len;
+      return line;
+    }
+  }
+  return NULL;
+}
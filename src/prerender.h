@@ -0,0 +1,33 @@
+#ifndef __PRERENDER_H__
+#define __PRERENDER_H__
+
+#include "utils.h"
+#include <stdint.h>
+
+/* The response line of every entry of a partition, rendered once when the
+ * node starts. The partition never changes, so a single-term lookup that hits
+ * it can send its line as it is instead of formatting the docids again.
+ *
+ * The lines are packed back to back in one arena whose size is computed
+ * exactly beforehand. They are indexed by an open-addressed table keyed by the
+ * hash_key of their key, whose slots hold the line's place in the arena, so a
+ * lookup goes straight from the key to its line and is checked against the
+ * key at the start of the line, without going through find_entry. */
+
+typedef struct prerender_slot {
+  uint32_t check; /* high half of the hash_key of the key */
+  uint32_t len;   /* of the line, including its newline; 0 if the slot is empty */
+  uint64_t off;   /* of the line in the arena */
+} prerender_slot;
+
+typedef struct prerendered {
+  char *text;
+  size_t text_len;
+  uint32_t nslots;        /* a power of two */
+  prerender_slot *slots;
+} prerendered;
+
+prerendered *prerender_build(database *db);
+const char *prerender_find(database *db, const char *key, uint32_t *len);
+
+#endif /* __PRERENDER_H__ */
@@ -0,0 +1,344 @@
+#include "csapp/csapp.h"
+#include "sbuf.h"
+#include "reactor.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 4096
+// Output queued by a handler is written out as soon as this much is pending.
+#define WRITE_CHUNK (64 * 1024)
+// Shortest output conn_write_static sends without copying it
+#define ZERO_COPY_MIN 4096
+// Stop reading from a client while this much output is still queued for it.
+#define WBUF_HIGH_WATER (1 << 20)
+// Most input read ahead for a connection. A client whose handler cannot make
+// out a request in this much input is disconnected.
+#define RBUF_LIMIT (64 * 1024)
+#define CONN_EVENTS (EPOLLRDHUP | EPOLLET | EPOLLONESHOT)
+
+static int epfd = -1;
+static conn **conns = NULL; // indexed by file descriptor
+static int max_conns = 0;
+static sbuf_t ready;        // descriptors with pending events
+static conn_handler handle;
+
+/** @brief Puts a file descriptor into non-blocking mode. */
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    unix_error("fcntl error");
+}
+
+/** @brief Makes sure buf has room for at least need more bytes after len. */
+static void reserve(char **buf, size_t *cap, size_t len, size_t need) {
+  if (len + need <= *cap)
+    return;
+  size_t ncap = *cap ? *cap : READ_CHUNK;
+  while (ncap < len + need)
+    ncap *= 2;
+  if ((*buf = realloc(*buf, ncap)) == NULL)
+    unix_error("realloc error");
+  *cap = ncap;
+}
+
+static int conn_flush(conn *c);
+
+/** @brief Returns room for len bytes of output at the end of the output queued
+ *         on a connection. The caller writes its output there and then queues
+ *         it with conn_commit, so it can format a response in place.
+ */
+char *conn_reserve(conn *c, size_t len) {
+  if (c->woff == c->wlen) {
+    c->woff = c->wlen = 0;
+  } else if (c->woff >= c->wcap / 2) {
+    // most of the buffer has been sent already
+    memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+    c->wlen -= c->woff;
+    c->woff = 0;
+  }
+  reserve(&c->wbuf, &c->wcap, c->wlen, len);
+  return c->wbuf + c->wlen;
+}
+
+/** @brief Queues len bytes written at the pointer conn_reserve returned. Output
+ *         is normally written to the socket once the handler returns, but a
+ *         long response is written out as it is produced, every WRITE_CHUNK
+ *         bytes, so that it does not have to be held in memory whole.
+ */
+void conn_commit(conn *c, size_t len) {
+  c->wlen += len;
+  // an error shows up again when the reactor flushes the connection
+  if (c->wlen - c->woff >= WRITE_CHUNK)
+    conn_flush(c);
+}
+
+/** @brief Queues len bytes of output on a connection. */
+void conn_write(conn *c, const char *buf, size_t len) {
+  memcpy(conn_reserve(c, len), buf, len);
+  conn_commit(c, len);
+}
+
+/** @brief Writes len bytes of output that stay valid and unchanged for the life
+ *         of the process. At least ZERO_COPY_MIN bytes are sent to the socket
+ *         straight from buf once the output queued before them has gone, and
+ *         only what the socket does not take is copied. Shorter output is
+ *         cheaper to copy and send together with the other responses.
+ */
+void conn_write_static(conn *c, const char *buf, size_t len) {
+  ssize_t n;
+
+  if (len >= ZERO_COPY_MIN && conn_flush(c) == 0 && c->woff == c->wlen) {
+    while (len > 0) {
+      n = send(c->fd, buf, len, MSG_NOSIGNAL);
+      if (n > 0) {
+        buf += n;
+        len -= n;
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else {
+        // the rest is queued, and any error shows up when it is flushed
+        break;
+      }
+    }
+  }
+  if (len > 0)
+    conn_write(c, buf, len);
+}
+
+static void conn_close(conn *c) {
+  if (c->release)
+    c->release(c->data);
+  conns[c->fd] = NULL;
+  close(c->fd);
+  free(c->rbuf);
+  free(c->wbuf);
+  free(c);
+}
+
+/** @brief Reads everything currently available on the socket, or until
+ *         RBUF_LIMIT bytes are buffered.
+ *  @return -1 on a socket error, 0 otherwise. c->eof is set on end of file.
+ */
+static int conn_fill(conn *c) {
+  ssize_t n;
+  while (c->rlen < RBUF_LIMIT) {
+    reserve(&c->rbuf, &c->rcap, c->rlen, READ_CHUNK);
+    n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+    if (n > 0) {
+      c->rlen += n;
+    } else if (n == 0) {
+      c->eof = 1;
+      return 0;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** @brief Writes as much pending output as the socket accepts.
+ *  @return -1 on a socket error, 0 otherwise.
+ */
+static int conn_flush(conn *c) {
+  ssize_t n;
+  while (c->woff < c->wlen) {
+    n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+    if (n > 0)
+      c->woff += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    else
+      return -1;
+  }
+  return 0;
+}
+
+/** @brief Passes buffered input to the handler until it stops consuming or
+ *         parks the connection.
+ */
+static void conn_consume(conn *c) {
+  size_t off = 0, used;
+  while (off < c->rlen && !c->suspended) {
+    used = handle(c, c->rbuf + off, c->rlen - off, c->eof);
+    if (used == 0)
+      break;
+    off += used;
+  }
+  memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+  c->rlen -= off;
+}
+
+/** @brief Called by a worker when the reactor reports activity on a
+ *         connection, or when a parked connection is resumed. Reads and
+ *         handles all complete requests, writes the responses, then either
+ *         closes the connection, re-arms it or leaves it parked.
+ */
+static void conn_service(conn *c) {
+  struct epoll_event ev;
+  int backlog = (c->wlen - c->woff) >= WBUF_HIGH_WATER;
+
+  c->suspended = 0;
+  __atomic_store_n(&c->holds, 1, __ATOMIC_RELAXED);
+  if (!backlog) {
+    if (!c->eof && conn_fill(c) < 0) {
+      conn_close(c);
+      return;
+    }
+    conn_consume(c);
+    // the handler found no whole request in all the input it may be given
+    if (!c->suspended && c->rlen >= RBUF_LIMIT) {
+      conn_close(c);
+      return;
+    }
+  }
+  if (c->suspended) {
+    // the responses before the parked request can go out already. An error
+    // shows up again once the connection is resumed.
+    conn_flush(c);
+    if (__atomic_sub_fetch(&c->holds, 1, __ATOMIC_ACQ_REL) == 0)
+      sbuf_insert(&ready, c->fd);
+    return;
+  }
+  if (conn_flush(c) < 0) {
+    conn_close(c);
+    return;
+  }
+  backlog = (c->wlen - c->woff) >= WBUF_HIGH_WATER;
+  if (c->eof && !backlog && c->woff == c->wlen) {
+    conn_close(c);
+    return;
+  }
+
+  ev.data.fd = c->fd;
+  ev.events = CONN_EVENTS;
+  if (!backlog && !c->eof)
+    ev.events |= EPOLLIN;
+  if (c->woff < c->wlen)
+    ev.events |= EPOLLOUT;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    conn_close(c);
+}
+
+/** @brief Stops reading from a connection. It is closed once the output queued
+ *         on it has been written.
+ */
+void conn_shutdown(conn *c) {
+  c->eof = 1;
+}
+
+/** @brief Parks a connection whose handler cannot answer the request at the
+ *         start of its input yet, for instance because it is waiting for
+ *         another node. The handler then returns 0. The connection is neither
+ *         read nor handled, and holds no worker, until conn_resume has been
+ *         called once for every call to conn_suspend; the handler is then
+ *         called again with the same input.
+ */
+void conn_suspend(conn *c) {
+  c->suspended = 1;
+  __atomic_add_fetch(&c->holds, 1, __ATOMIC_RELAXED);
+}
+
+/** @brief Ends one conn_suspend of a connection. May be called from any
+ *         thread, even before the handler that parked the connection returns.
+ */
+void conn_resume(conn *c) {
+  if (__atomic_sub_fetch(&c->holds, 1, __ATOMIC_ACQ_REL) == 0)
+    sbuf_insert(&ready, c->fd);
+}
+
+static void *worker(void *vargp) {
+  Pthread_detach(pthread_self());
+  while (1) {
+    int fd = sbuf_remove(&ready);
+    conn_service(conns[fd]);
+  }
+  return NULL;
+}
+
+/** @brief Accepts every pending connection on the listening socket and
+ *         registers it with the reactor.
+ */
+static void accept_all(int listen_fd) {
+  struct epoll_event ev;
+  int connfd, one = 1;
+  conn *c;
+
+  while ((connfd = accept(listen_fd, NULL, NULL)) >= 0) {
+    if (connfd >= max_conns) {
+      fprintf(stderr, "reactor: too many connections\n");
+      close(connfd);
+      continue;
+    }
+    set_nonblocking(connfd);
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c = Calloc(1, sizeof(conn));
+    c->fd = connfd;
+    conns[connfd] = c;
+    ev.data.fd = connfd;
+    ev.events = EPOLLIN | CONN_EVENTS;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+      conn_close(c);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+      && errno != ECONNABORTED)
+    fprintf(stderr, "reactor: accept error: %s\n", strerror(errno));
+}
+
+/** @brief Runs an edge-triggered epoll loop on listen_fd forever. The calling
+ *         thread only accepts connections and waits for events; reading,
+ *         handling and writing is done by a fixed pool of nthreads workers.
+ *
+ *  @param listen_fd listening socket to accept connections on
+ *  @param nthreads number of worker threads to create
+ *  @param handler called by the workers with the buffered input of a
+ *         connection. Responses are queued with conn_write.
+ */
+void reactor_run(int listen_fd, int nthreads, conn_handler handler) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct rlimit rl;
+  pthread_t tid;
+  int n;
+
+  handle = handler;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    max_conns = (int) rl.rlim_cur;
+  else
+    max_conns = 65536;
+  conns = Calloc(max_conns, sizeof(conn *));
+
+  if ((epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  set_nonblocking(listen_fd);
+  ev.data.fd = listen_fd;
+  ev.events = EPOLLIN | EPOLLET;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  // Every connection is in the ready queue at most once, so this never fills.
+  sbuf_init(&ready, max_conns);
+  for (int i = 0; i < nthreads; i++)
+    Pthread_create(&tid, NULL, worker, NULL);
+
+  while (1) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == listen_fd)
+        accept_all(listen_fd);
+      else
+        sbuf_insert(&ready, events[i].data.fd);
+    }
+  }
+}
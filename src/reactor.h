@@ -0,0 +1,42 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stddef.h>
+
+/* A client connection owned by the reactor. Connections are registered with
+ * EPOLLONESHOT, and a connection parked with conn_suspend is not served until
+ * it is resumed, so at most one worker thread touches a connection at any
+ * time and none of these fields but holds need locking. */
+typedef struct conn {
+  int fd;
+  char *rbuf;      /* bytes read from the socket but not yet consumed */
+  size_t rlen;
+  size_t rcap;
+  char *wbuf;      /* bytes queued for the socket but not yet written */
+  size_t woff;     /* wbuf[woff..wlen) is still pending */
+  size_t wlen;
+  size_t wcap;
+  int eof;         /* no more input is read: the client has closed its side
+                      of the connection, or the handler called conn_shutdown */
+  int suspended;   /* the handler parked the connection during this pass */
+  int holds;       /* conn_suspend calls not yet matched by conn_resume, plus
+                      one while a worker serves it; updated atomically */
+  void *data;      /* for the handler, which sets release to free it */
+  void (*release)(void *data); /* called when the connection is closed */
+} conn;
+
+/* Called by a worker with the unconsumed input of a connection. Returns the
+ * number of bytes consumed, or 0 if more input is needed. eof is set when no
+ * more input will arrive. */
+typedef size_t (*conn_handler)(conn *c, char *buf, size_t len, int eof);
+
+void reactor_run(int listen_fd, int nthreads, conn_handler handler);
+char *conn_reserve(conn *c, size_t len);
+void conn_commit(conn *c, size_t len);
+void conn_write(conn *c, const char *buf, size_t len);
+void conn_write_static(conn *c, const char *buf, size_t len);
+void conn_shutdown(conn *c);
+void conn_suspend(conn *c);
+void conn_resume(conn *c);
+
+#endif /* __REACTOR_H__ */
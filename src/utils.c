@@ -1,4 +1,7 @@
 #include "utils.h" 
+#include "postings.h"
+#include "db_index.h"
+#include "mph.h"
 #include "csapp/csapp.h"
 #include <errno.h>
 #include <stdio.h>
@@ -10,6 +13,9 @@
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /** @brief round up 'n' to the nearest multiple of 'mult'. This function assumes
  *         that mult is a power of two.
@@ -17,9 +23,102 @@
 size_t round_up(size_t n, size_t mult) { return (n + (mult-1)) & ~(mult-1); }
 
 
+/** @brief  Multiplies two 64-bit values and folds the 128-bit product. */
+static inline uint64_t hash_mum(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/** @brief  Hashes a key of the given length, eight bytes at a time, in the
+ *          style of wyhash. The hash tables and the prebuilt index (see
+ *          db_index.h) both use it, so it must not change without bumping
+ *          DB_INDEX_VERSION.
+*/
+uint64_t hash_key(const char *key, size_t len) {
+  uint64_t h = 0xa0761d6478bd642full ^ len, w;
+  size_t i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, key + i, 8);
+    h = hash_mum(h ^ w, 0xe7037ed1a0b428dbull);
+  }
+  w = 0;
+  memcpy(&w, key + i, len - i);
+  h = hash_mum(h ^ w ^ 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull ^ len);
+  return hash_mum(h, 0x1d8e4e27c47d124full);
+}
+
+/** @brief  Allocates an empty hash table with room for at least n words
+ *          before it has to grow.
+*/
+static hash_table *create_hash_table(size_t n) {
+  hash_table *ht = Malloc(sizeof(hash_table));
+  size_t buckets = MIN_BUCKETS;
+  while (buckets * MAX_LOAD_NUM < n * MAX_LOAD_DEN)
+    buckets <<= 1;
+  ht->num_buckets = buckets;
+  ht->count = 0;
+  ht->ctrl = Malloc(buckets);
+  memset(ht->ctrl, CTRL_EMPTY, buckets);
+  ht->buckets = Malloc(buckets * sizeof(bucket));
+  return ht;
+}
+
+/** @brief  Returns a bit mask of the buckets in the group starting at g whose
+ *          control byte equals c.
+*/
+static inline unsigned int match_group(const uint8_t *ctrl, unsigned int g, uint8_t c) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *) (ctrl + g));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) c)));
+#else
+  unsigned int mask = 0;
+  for (int i = 0; i < HT_GROUP; i++)
+    mask |= (unsigned int) (ctrl[g + i] == c) << i;
+  return mask;
+#endif
+}
+
+/** @brief  Returns the index of the first empty bucket on the probe sequence
+ *          of a hash. Groups are probed in triangular order, which visits
+ *          every group of a power-of-two table.
+*/
+static unsigned int find_empty(hash_table *ht, uint32_t hash) {
+  unsigned int gmask = ht->num_buckets - HT_GROUP, g = (hash * HT_GROUP) & gmask, empty;
+  for (unsigned int step = HT_GROUP; ; g = (g + step) & gmask, step += HT_GROUP) {
+    if ((empty = match_group(ht->ctrl, g, CTRL_EMPTY)) != 0)
+      return g + __builtin_ctz(empty);
+  }
+}
+
+/** @brief  Doubles the number of buckets of a hash table. Words are moved to
+ *          their new buckets using their stored hashes.
+*/
+static void grow_hash_table(hash_table *ht) {
+  bucket *old = ht->buckets;
+  uint8_t *old_ctrl = ht->ctrl;
+  int old_buckets = ht->num_buckets;
+  unsigned int h;
+
+  ht->num_buckets *= 2;
+  ht->ctrl = Malloc(ht->num_buckets);
+  memset(ht->ctrl, CTRL_EMPTY, ht->num_buckets);
+  ht->buckets = Malloc(ht->num_buckets * sizeof(bucket));
+  for (int i = 0; i < old_buckets; i++) {
+    if (old_ctrl[i] == CTRL_EMPTY)
+      continue;
+    h = find_empty(ht, old[i].hash);
+    ht->ctrl[h] = old_ctrl[i];
+    ht->buckets[h] = old[i];
+  }
+  free(old);
+  free(old_ctrl);
+}
+
 /** @brief Creates a hash table used to lookup database entries. The hash table
  *         is created by reading the entries in db->m_ptr. After returning from 
  *         this function, db->h_table will point to the newly created hash table
+ *         The table is sized from the number of entries, so it never has to
+ *         grow while it is being built.
  * 
  *  @param db the database struct to construct the hash table for
  *  
@@ -28,48 +127,47 @@ size_t round_up(size_t n, size_t mult) { return (n + (mult-1)) & ~(mult-1); }
 */
 void build_hash_table(database *db) {
   hash_table *ht; 
-  char *curr_offset = db->m_ptr;
-  int index;
+  char *curr_offset;
+  size_t entries = 0;
 
-  ht = calloc(1, sizeof(hash_table)); 
-  ht->num_buckets = NUM_BUCKETS;
-  ht->buckets = calloc(NUM_BUCKETS, sizeof(bucket)); 
+  for (curr_offset = db->m_ptr; curr_offset < DB_END(db); curr_offset = next_entry(db, curr_offset))
+    entries++;
+  ht = create_hash_table(entries);
 
+  curr_offset = db->m_ptr;
   while (curr_offset < db->m_ptr + db->db_size) {
-    index = lookup_insert(ht, curr_offset); 
-    ht->buckets[index].used = 1;
-    ht->buckets[index].word = curr_offset;
-    curr_offset = get_next_key_offset(curr_offset); 
+    lookup_insert(ht, curr_offset); 
+    curr_offset = next_entry(db, curr_offset); 
   }
   db->h_table = ht;
 }
 
-/** @brief  Find a free slot in a hash table for the given word. The index of
- *          the bucket that the word can be inserted into is returned. 
+/** @brief  Inserts a word into a hash table, growing the table first if it is
+ *          too full.
  * 
  *  @param  ht hash table to insert the word into 
  *  @param  word word to insert into the hash table
- *  @return index at which the word can be inserted
+ *  @return index of the bucket the word was inserted into
 */
 int lookup_insert(hash_table *ht, char *word) {
-  int i;
-  unsigned int h, o, k = 0;
-  for (i = 0; word[i]; i++)
-    k = (k * 33) + word[i];
-  h = k % (ht->num_buckets);
-  o = 1 + (k % (ht->num_buckets - 1));
-  for (i = 0; i < ht->num_buckets; i++) {
-    if (ht->buckets[h].used == 0) return h;
-    h += o;
-    if (h >= (unsigned int)ht->num_buckets)
-      h = h - ht->num_buckets;
-  }
-  fprintf(stderr, "pedsort: hash table full\n");
-  exit(1);
+  size_t len = strlen(word);
+  uint32_t hash = hash_key(word, len);
+  unsigned int h;
+
+  if ((size_t) (ht->count + 1) * MAX_LOAD_DEN > (size_t) ht->num_buckets * MAX_LOAD_NUM)
+    grow_hash_table(ht);
+  h = find_empty(ht, hash);
+  ht->ctrl[h] = HT_TAG(hash);
+  ht->buckets[h].word = word;
+  ht->buckets[h].hash = hash;
+  ht->buckets[h].len = len;
+  ht->count++;
+  return h;
 }
 
 /** @brief  Searches a hash table for a given word, and returns the index where
- *          the word is found. 
+ *          the word is found. Only words whose fingerprint, hash and length
+ *          all match are compared.
  * 
  *  @param  ht hash table to search
  *  @param  word word to search for
@@ -77,18 +175,20 @@ int lookup_insert(hash_table *ht, char *word) {
  *          found.
  */
 int lookup_find(hash_table *ht, char *word) {
-  int i;
-  unsigned int h, o, k = 0;
-  for (i = 0; word[i]; i++) k = (k * 33) + word[i];
-  h = k % (ht->num_buckets);
-  o = 1 + (k % (ht->num_buckets - 1));
-  for (i = 0; i < ht->num_buckets; i++) {
-    if (ht->buckets[h].used && (strcmp(ht->buckets[h].word, word) == 0))
-      return h;
-    h += o;
-    if (h >= (unsigned int)ht->num_buckets) h = h - ht->num_buckets;
+  size_t len = strlen(word);
+  uint32_t hash = hash_key(word, len);
+  unsigned int gmask = ht->num_buckets - HT_GROUP, g = (hash * HT_GROUP) & gmask, match, h;
+
+  for (unsigned int step = HT_GROUP; ; g = (g + step) & gmask, step += HT_GROUP) {
+    for (match = match_group(ht->ctrl, g, HT_TAG(hash)); match; match &= match - 1) {
+      h = g + __builtin_ctz(match);
+      if (ht->buckets[h].hash == hash && ht->buckets[h].len == len
+          && memcmp(ht->buckets[h].word, word, len) == 0)
+        return h;
+    }
+    if (match_group(ht->ctrl, g, CTRL_EMPTY))
+      return -1;
   }
-  return -1;
 }
 
 /** @brief  Gets the file size of a file known by the given file descriptor.
@@ -118,7 +218,10 @@ off_t get_filesize(int fd) {
  *  @param  db_filename filename of the database to load into memory. 
  * 
  *  @return a pointer to a newly allocated database struct
- * 
+ *
+ *  @note   A file that starts with a db_header is in the block-compressed
+ *          format; m_ptr and db_size then describe the entries after the
+ *          header, and map_ptr and map_size the whole mapping.
  *  @note   This function should ONLY be called by the parent process in the 
  *          digest phase. Individual nodes receive their partition of the 
  *          database by sending requests to the parent process, not by loading
@@ -141,9 +244,25 @@ database *load_database(char *db_filename) {
     exit(1);
   }
   Close(db_fd);
-  db->db_size = size;
-  db->h_table = NULL;
-  db->m_ptr   = ptr;
+  db->map_ptr  = ptr;
+  db->map_size = size;
+  db->h_table  = NULL;
+  db->index    = NULL;
+  db->mph      = NULL;
+  db->base     = 0;
+  db->format   = DB_FORMAT_RAW;
+  db->m_ptr    = ptr;
+  db->db_size  = size;
+  if (size >= sizeof(db_header) && memcmp(ptr, DB_MAGIC, DB_MAGIC_LEN) == 0) {
+    db_header *hdr = (db_header *) ptr;
+    if (hdr->format != DB_FORMAT_BLOCKS || hdr->block_size != POSTING_BLOCK) {
+      fprintf(stderr, "unsupported database format %u\n", hdr->format);
+      exit(1);
+    }
+    db->format  = DB_FORMAT_BLOCKS;
+    db->m_ptr   = ptr + sizeof(db_header);
+    db->db_size = size - sizeof(db_header);
+  }
   return db; 
 }
 
@@ -163,43 +282,96 @@ value_array *get_value_array(char *entry_offset) {
 }
 
 
-/** @brief  Allocate memory for a value array and populate it with the values in 
- *          the entry that starts at the given offset.
- * 
- *  @param  entry_str An entry in "string form". This is the key followed by a 
- *          commma separated list of values. 
- *  @return Pointer to the newly created value array, or NULL if there was a 
- *          problem when converting the string to a value array.
- *  
- *  @note   You may find this function useful when implementing intersection 
- *          requests between keys that are in different nodes, and you need to 
- *          convert the response you receive from the other node from string 
- *          form to a value_array. 
- *  @note   Remember to free the memory that this function allocates when you're
- *          done with it!
+/** @brief  Packs a value array into a binary form that can be sent to another
+ *          node. The payload is an encoding byte and the array length, followed
+ *          either by the raw values or, when it is smaller, by the first value
+ *          and the gaps between consecutive values as variable-byte integers.
+ *
+ *  @param  va the value array to pack. Its values must be sorted.
+ *  @param  len set to the length of the packed payload
+ *  @return Pointer to the newly allocated payload. The caller must free it.
 */
-value_array *create_value_array(char *entry_str) {
-  value_array *va;
-  int ccount = 0;
-  char *str  = strchr(entry_str, ','); // skip to first comma
-  if (!str) 
-    return NULL;
+char *value_array_pack(value_array *va, uint32_t *len) {
+  size_t raw = VA_PACK_HDR + (size_t) va->len * sizeof(uint32_t);
+  char *buf = malloc(VA_PACK_HDR + (size_t) va->len * 5);
+  unsigned char *p = (unsigned char *) buf + VA_PACK_HDR;
+  uint32_t prev = 0, gap, n = htonl(va->len);
+
+  memcpy(buf + 1, &n, sizeof(n));
+  for (int i = 0; i < va->len; i++) {
+    gap = va->arr[i] - prev;
+    prev = va->arr[i];
+    while (gap >= 0x80) {
+      *p++ = (gap & 0x7f) | 0x80;
+      gap >>= 7;
+    }
+    *p++ = gap;
+  }
+  *len = (char *) p - buf;
+  if (*len < raw) {
+    buf[0] = VA_ENC_VARINT;
+    return buf;
+  }
+
+  buf[0] = VA_ENC_RAW;
+  for (int i = 0; i < va->len; i++) {
+    n = htonl(va->arr[i]);
+    memcpy(buf + VA_PACK_HDR + i * sizeof(uint32_t), &n, sizeof(n));
+  }
+  *len = raw;
+  return buf;
+}
 
-  for (char *c = str; *c != '\0'; c++) // number of commas = len of array
-    if (*c == ',') 
-      ccount++;
+/** @brief  Allocates a value array and fills it from a payload created by
+ *          value_array_pack.
+ *
+ *  @return Pointer to the newly created value array, or NULL if the payload is
+ *          malformed. The caller must free it.
+*/
+value_array *value_array_unpack(const char *buf, uint32_t len) {
+  const unsigned char *p = (const unsigned char *) buf + VA_PACK_HDR;
+  const unsigned char *end = (const unsigned char *) buf + len;
+  uint32_t n, v = 0, gap;
+  value_array *va;
+  int shift;
 
-  va = malloc(sizeof(value_array) + (ccount * sizeof(int))); 
-  if (va == NULL)
+  if (len < VA_PACK_HDR)
+    return NULL;
+  memcpy(&n, buf + 1, sizeof(n));
+  n = ntohl(n);
+  if (n > len) // every value takes at least one byte
     return NULL;
+  va = malloc(sizeof(value_array) + n * sizeof(unsigned int));
+  va->len = n;
 
-  va->len = ccount;
-  for (int i = 0; i < ccount; i++) {
-    if (sscanf(str, ",%u", va->arr+i) <= 0) {
+  if (buf[0] == VA_ENC_RAW) {
+    if (len != VA_PACK_HDR + n * sizeof(uint32_t)) {
       free(va);
       return NULL;
     }
-    str = strchr(++str, ',');
+    for (uint32_t i = 0; i < n; i++) {
+      memcpy(&v, p + i * sizeof(uint32_t), sizeof(v));
+      va->arr[i] = ntohl(v);
+    }
+    return va;
+  } else if (buf[0] != VA_ENC_VARINT) {
+    free(va);
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < n; i++) {
+    gap = 0;
+    shift = 0;
+    do {
+      if (p == end || shift > 28) {
+        free(va);
+        return NULL;
+      }
+      gap |= (uint32_t) (*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+    v += gap;
+    va->arr[i] = v;
   }
   return va;
 }
@@ -215,68 +387,75 @@ value_array *create_value_array(char *entry_str) {
  * 
  *  @note   This function allocates memory using malloc. If you call this 
  *          function you will need to later free the return value yourself.
- *  @note   You don't /need/ to modify this method, but if you want to implement
- *          a more efficient way of calculating the intersection you are free to
- *          do so. 
+ *  @note   The work is done by postings_intersect, which picks a merge,
+ *          galloping or SIMD kernel depending on the list lengths.
 */
 value_array *get_intersection(value_array *va_1, value_array *va_2) {
-  int i, j, k = 0;
-  value_array *dst;
-  
-  if ((va_1 == NULL) || (va_2 == NULL)) {
-    return NULL;
-  }
+  return postings_intersect(va_1, va_2);
+}
 
-  dst = malloc(sizeof(value_array) + (va_1->len * sizeof(unsigned int))); 
-  for (i = 0; i < va_1->len; i++) {
-    if (i > 0 && va_1->arr[i] == va_1->arr[i-1]) // skip duplicates in va_1
-      continue;
-    for (j = 0; j < va_2->len; j++) {
-      if (va_2->arr[j] > va_1->arr[i]) 
-        break;
-      else if (va_1->arr[i] == va_2->arr[j]) {
-        dst->arr[k++] = va_1->arr[i]; 
-        break; // skip duplicates in va_2
-      }
-    }
-    dst->len = k; 
-  }
+// "00" to "99", so that a value can be written two digits at a time
+static const char digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static const uint32_t pow10_u32[10] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
 
-  return dst;
+/** @brief  Returns the number of decimal digits of v, without a loop. The
+ *          number of bits of v times log10(2), as 1233 / 4096, is the number
+ *          of digits or one less, which one comparison settles.
+ */
+static inline int u32_digits(uint32_t v) {
+  int t = ((32 - __builtin_clz(v | 1)) * 1233) >> 12;
+  return t + ((v | 1) >= pow10_u32[t]);
 }
 
-/** @brief  Converts the value array to a string. The string is stored in the
- *          given buffer. Returns number of characters written.
- *  @note   This function will write a ',' before the first value in the array.
- * 
- *  @param  va Pointer to a value_array to convert to a string
- *  @param  buffer Buffer to write to
- *  @param  len Length of buffer. 
- *  @return Number of characters written to the buffer
-*/
-int value_array_to_str(value_array *va, char *buffer, int len) {
-  int wl = 0; 
-  for (int i = 0; i < va->len; i++) {
-    wl += snprintf(buffer+wl, len-wl, ",%u", va->arr[i]);
+/** @brief  Writes the digits of v, of which there are digits, to p from the
+ *          last pair to the first.
+ */
+static inline void write_u32(char *p, uint32_t v, int digits) {
+  char *end = p + digits;
+  while (v >= 100) {
+    end -= 2;
+    memcpy(end, &digit_pairs[(v % 100) * 2], 2);
+    v /= 100;
   }
-  wl += snprintf(buffer+wl, len-wl, "\n"); 
-  return wl;
+  if (v >= 10)
+    memcpy(end - 2, &digit_pairs[v * 2], 2);
+  else
+    end[-1] = '0' + v;
 }
 
-/** @brief  Writes an entry in string form (the key followed by the comma 
- *          separated list of values) to a given buffer. The last value is 
- *          followed by a newline character.
- * 
- *  @param  entry_offset Pointer to the start of an entry. This function makes 
- *          no checks regarding the validity of the entry. 
- *  @param  buffer Location to which the resulting string is written to. 
- *  @param  len Size of the buffer.
- *  @return The total number of characters written to the buffer.
+/** @brief  Returns the exact length of the text values_to_str writes for n
+ *          values.
+ */
+size_t values_str_len(const unsigned int *arr, int n) {
+  size_t len = n;
+  for (int i = 0; i < n; i++)
+    len += u32_digits(arr[i]);
+  return len;
+}
+
+/** @brief  Writes n values as text, each preceded by a ',', without the
+ *          newline that ends a response line or a NUL. Used to format a
+ *          long list a piece at a time.
+ *
+ *  @param  buffer Buffer to write to, with room for values_str_len(arr, n)
+ *          bytes, which is at most VALUE_STR_MAX * n
+ *  @return Number of characters written to the buffer.
 */
-int entry_to_str(char *entry_offset, char *buffer, int len) {
-  int n = 0; 
-  n = snprintf(buffer, len, "%s", entry_offset); 
-  return n + value_array_to_str(get_value_array(entry_offset), buffer+n, len-n);
+int values_to_str(const unsigned int *arr, int n, char *buffer) {
+  char *p = buffer;
+  for (int i = 0; i < n; i++) {
+    int d = u32_digits(arr[i]);
+    *p++ = ',';
+    write_u32(p, arr[i], d);
+    p += d;
+  }
+  return p - buffer;
 }
 
 /** @brief  Given a pointer to the start of an entry stored in the memory-mapped 
@@ -287,6 +466,8 @@ int entry_to_str(char *entry_offset, char *buffer, int len) {
  *          checks on the validity of the entry_offset.
  *  @return A pointer to the start of the next entry.
  *  
+ *  @note   This function only understands the DB_FORMAT_RAW layout; use
+ *          next_entry to walk a database of any format.
  *  @note   This function does not check whether the address returned is a valid
  *          entry in the memory-mapped database. You may have to check that the
  *          the return value is still in the "range" of the memory-mapped region
@@ -298,26 +479,135 @@ char *get_next_key_offset(char *entry_offset) {
 }
 
 
+/** @brief  Given a pointer to the start of an entry in the given database,
+ *          returns a pointer to the start of the next entry. Unlike
+ *          get_next_key_offset this works for every database format.
+*/
+char *next_entry(database *db, char *entry_offset) {
+  const block_postings *bp;
+  if (db->format == DB_FORMAT_RAW)
+    return get_next_key_offset(entry_offset);
+  bp = get_block_postings(entry_offset);
+  return (char *) bp + round_up(block_postings_end(bp) - (char *) bp, sizeof(int));
+}
+
+/** @brief Given a pointer to the start of an entry in a DB_FORMAT_BLOCKS
+ *         database, returns a pointer to the entry's compressed posting list.
+*/
+block_postings *get_block_postings(char *entry_offset) {
+  return (block_postings *) (entry_offset + round_up(strlen(entry_offset)+1, sizeof(int)));
+}
+
+/** @brief  Returns the values of an entry in any database format. 
+ *
+ *  @param  owned set to 1 if the entry was decoded into a newly allocated
+ *          value_array that the caller must free, or 0 if the returned array
+ *          points into the database.
+*/
+value_array *get_entry_values(database *db, char *entry_offset, int *owned) {
+  *owned = db->format != DB_FORMAT_RAW;
+  if (db->format == DB_FORMAT_RAW)
+    return get_value_array(entry_offset);
+  return block_postings_decode(get_block_postings(entry_offset));
+}
+
 /** @brief  Determines which node a key belongs to. 
  *  
- *  @param  key The key to find the 'owner' node of. This function assumes that
- *          the first character of the key is a valid starting character.
- *  @param  total_nodes The total number of nodes
+ *  @param  routes The key ranges of the nodes, as planned by plan_partitions.
+ *  @param  key The key to find the 'owner' node of. Any string can be routed.
  *  @return id of the node that should contain the given key.
  * 
  *  @note   You should use this function when you start implementing forwarding
  *          requests between multiple nodes.
 */
-int find_node(char *key, int total_nodes) {
-  return MIN(((*key - '0') / (KEY_SPACE/total_nodes)), total_nodes-1); 
+int find_node(routing_table *routes, char *key) {
+  int lo = 0, hi = routes->nbounds, mid;
+  // the number of bounds that are <= key
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(routes->bounds[mid], key) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/** @brief  Splits a database into total_nodes ranges of keys holding about the
+ *          same number of bytes each.
+ *
+ *          The entries are expected to be sorted, but a split is only placed
+ *          where every key before it is smaller than every key after it, so a
+ *          database that is only partly sorted (for example by its first
+ *          character) still gets a consistent routing table; its ranges are
+ *          then only as balanced as its sorted runs allow. Each range starts
+ *          at the split closest to its share of the database. Ranges can be
+ *          empty, and nodes after the last bound own no keys at all.
+ *
+ *  @param  db The database that is to be partitioned. 
+ *  @param  total_nodes Total number of nodes to partition the database between
+ *  @return A newly allocated plan. Its bounds point into the database.
+ *
+ *  @note   This function is used by the parent process in the digest phase, the
+ *          nodes themselves receive the routing table from the parent.
+*/
+partition_plan *plan_partitions(database *db, int total_nodes) {
+  partition_plan *plan = Malloc(sizeof(partition_plan));
+  char **entries, **prefix_max, **suffix_min;
+  size_t n = 0, i, target, cut = 0, prev_cut;
+  char *curr;
+
+  for (curr = db->m_ptr; curr < DB_END(db); curr = next_entry(db, curr))
+    n++;
+  entries = Malloc((n + 1) * sizeof(char *));
+  prefix_max = Malloc((n + 1) * sizeof(char *));
+  suffix_min = Malloc((n + 1) * sizeof(char *));
+  for (i = 0, curr = db->m_ptr; curr < DB_END(db); curr = next_entry(db, curr))
+    entries[i++] = curr;
+  entries[n] = DB_END(db);
+
+  // a split before entry i is valid if prefix_max[i] < suffix_min[i]
+  prefix_max[0] = NULL;
+  for (i = 0; i < n; i++)
+    prefix_max[i + 1] = (prefix_max[i] && strcmp(prefix_max[i], entries[i]) > 0) ? prefix_max[i] : entries[i];
+  suffix_min[n] = NULL;
+  for (i = n; i > 0; i--)
+    suffix_min[i - 1] = (suffix_min[i] && strcmp(suffix_min[i], entries[i - 1]) < 0) ? suffix_min[i] : entries[i - 1];
+
+  plan->total_nodes = total_nodes;
+  plan->starts = Malloc((total_nodes + 1) * sizeof(char *));
+  plan->routes.bounds = Malloc(total_nodes * sizeof(char *));
+  plan->routes.nbounds = 0;
+  plan->starts[0] = db->m_ptr;
+  for (int node = 1; node < total_nodes; node++) {
+    target = db->db_size / total_nodes * node;
+    // the last valid split at or before the target, then the first after it;
+    // the end of the database is always a valid split
+    prev_cut = cut;
+    for (i = cut; i < n && (size_t) (entries[i] - db->m_ptr) <= target; i++)
+      if (i == 0 || strcmp(prefix_max[i], suffix_min[i]) < 0)
+        prev_cut = i;
+    for (cut = i; cut < n && strcmp(prefix_max[cut], suffix_min[cut]) >= 0; cut++)
+      ;
+    if (target - (entries[prev_cut] - db->m_ptr) <= (size_t) (entries[cut] - db->m_ptr) - target)
+      cut = prev_cut;
+    plan->starts[node] = entries[cut];
+    if (cut < n)
+      plan->routes.bounds[plan->routes.nbounds++] = suffix_min[cut];
+  }
+  plan->starts[total_nodes] = DB_END(db);
+
+  free(entries);
+  free(prefix_max);
+  free(suffix_min);
+  return plan;
 }
 
 /** @brief  Determine which section of the database should be sent to a given 
  *          node. Called by the parent process in the digest phase to figure out
  *          the section of the database to send to a node.
  * 
- *  @param  db The database that is to be partitioned. 
- *  @param  total_nodes Total number of nodes to partition the database between
+ *  @param  plan The partitioning of the database, from plan_partitions.
  *  @param  node_id The ID of the node that the partition will be sent to. 
  *  @param  length A pointer to a variable that will contain the size of the 
  *          partition after this function returns. 
@@ -328,24 +618,15 @@ int find_node(char *key, int total_nodes) {
  *  @note   This function is used by the parent process in the digest phase, the
  *          nodes themselves do not need to call this function.
 */
-char *get_partition(database *db, int total_nodes, int node_id, size_t *length) {
-  char start = (node_id * (KEY_SPACE / total_nodes)) + '0'; 
-  char end = ((node_id+1) * (KEY_SPACE / total_nodes)) + '0';
-  char *curr = db->m_ptr;
-  while ((curr < DB_END(db)) && (*curr < start)) {
-    curr = get_next_key_offset(curr); 
-  }
-  char *start_ptr = curr;
-  while ((curr < DB_END(db)) && ((*curr < end) || (node_id == total_nodes-1))) {
-    curr = get_next_key_offset(curr); 
-  }
-  *length = (size_t) (curr - start_ptr); 
-  return start_ptr;
+char *get_partition(partition_plan *plan, int node_id, size_t *length) {
+  *length = (size_t) (plan->starts[node_id + 1] - plan->starts[node_id]); 
+  return plan->starts[node_id];
 }
 
 /** @brief  Given a key and a database, searches for the key in the database's
- *          hash table. If it is found, returns a pointer to the start of the 
- *          entry in the database. If it is not found, returns NULL.
+ *          hash table, or in its prebuilt or perfect hash index if it has one.
+ *          If it is found, returns a pointer to the start of the entry in the
+ *          database. If it is not found, returns NULL.
  * 
  *  @param  db  The database to search.
  *  @param  key The key to look for in the database's hash table.
@@ -354,6 +635,10 @@ char *get_partition(database *db, int total_nodes, int node_id, size_t *length)
 */
 char *find_entry(database *db, char *key) {
   int idx;
+  if ((db->m_ptr != NULL) && (db->index != NULL))
+    return db_index_find(db, key);
+  if ((db->m_ptr != NULL) && (db->mph != NULL))
+    return mph_find(db, key);
   if ((db->m_ptr == NULL) || (db->h_table == NULL))
     return NULL;
   if ((idx = lookup_find(db->h_table, key)) == -1) 
@@ -398,28 +683,3 @@ int port_number_to_str(int port, char *buff) {
   }
   return snprintf(buff, 6, "%d", (unsigned short) port);
 }
-
-
-int is_found(char* key, char* result) {
-  char* not_found = (char*) malloc(2048);
-  sprintf(not_found, "%s not found\n", key);
-  if (strcmp(not_found, result) == 0){
-    free(not_found);
-    return 0;
-  }
-  free(not_found);
-  return 1;
-}
-
-char* generate_not_found(char* key) {
-  char* not_found = (char*) malloc(2048);
-  sprintf(not_found, "%s not found\n", key);
-  return not_found;
-}
-
-
-char* generate_two_not_found(char* key1, char* key2) {
-  char* not_found = (char*) malloc(2048);
-  sprintf(not_found, "%s not found\n%s not found\n", key1, key2);
-  return not_found;  
-}
\ No newline at end of file
@@ -1,7 +1,21 @@
-#include <sys/types.h>
+#ifndef __UTILS_H__
+#define __UTILS_H__
 
-#define NUM_BUCKETS 8191
-#define KEY_SPACE (((int) 'z') - ((int) '0'))
+#include <sys/types.h>
+#include <stdint.h>
+
+// Buckets are probed in groups of this many, one control byte each
+#define HT_GROUP 16
+// Smallest number of buckets in a hash table (a power of two, >= HT_GROUP)
+#define MIN_BUCKETS 16
+// Control byte of an empty bucket. A used bucket's control byte holds the
+// 7-bit fingerprint HT_TAG of its word's hash.
+#define CTRL_EMPTY 0x80
+#define HT_TAG(hash) (((hash) >> 25) & 0x7f)
+// A hash table grows once more than MAX_LOAD_NUM/MAX_LOAD_DEN of its buckets
+// are used.
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
 #define GET_BUCKET(db, idx) ((db)->h_table->buckets[(idx)])
 #define MIN(a, b) ((a)<(b) ? (a) : (b))
 #define DB_END(db) (((db)->m_ptr) + ((db)->db_size))
@@ -12,38 +26,109 @@
 
 // A single bucket in the hash table. 
 // Since word points directly into the memory-mapped database, there is no need
-// to explicitly keep track of the offset.
+// to explicitly keep track of the offset. The hash and length of the word are
+// kept so that probing and growing the table never have to look at the word
+// itself, and the word is only compared once both match.
 typedef struct bucket {
   char *word;
-  int used;
+  uint32_t hash;
+  uint32_t len;
 } bucket;
 
+// The buckets are split into groups of HT_GROUP, and a word's hash picks the
+// group probing starts at. The control bytes of a whole group fit in one
+// cache line and are matched against a fingerprint of the hash at once, so a
+// lookup usually reads one line of control bytes and one bucket.
 typedef struct hash_table {
-  int num_buckets; // number of buckets the hash table contains
+  int num_buckets; // number of buckets the hash table contains, a power of two
+  int count;       // number of buckets in use
+  uint8_t *ctrl;   // a control byte for each bucket
   bucket *buckets; // an array of size num_buckets
 } hash_table;
 
+// Encodings of a packed value array (see value_array_pack).
+#define VA_ENC_RAW    0 /* big-endian uint32 values */
+#define VA_ENC_VARINT 1 /* first value, then gaps, as LEB128 varints */
+#define VA_PACK_HDR   5 /* encoding byte followed by a big-endian uint32 length */
+
+// Longest text form of one value in a response, ",4294967295"
+#define VALUE_STR_MAX 11
+
 // The value array associated with a key in the database.
 typedef struct value_array {
   int len; 
   unsigned int arr[];
 } value_array; 
 
+// Database file formats. A DB_FORMAT_BLOCKS file starts with a db_header; a
+// DB_FORMAT_RAW file has no header and starts with its first entry.
+#define DB_FORMAT_RAW    1 /* key, then a value_array */
+#define DB_FORMAT_BLOCKS 2 /* key, then a block_postings */
+#define DB_MAGIC "\x7fIIDX\0\0\0"
+#define DB_MAGIC_LEN 8
+// Number of values in each compressed block of a DB_FORMAT_BLOCKS posting list
+#define POSTING_BLOCK 128
+
+typedef struct db_header {
+  char magic[DB_MAGIC_LEN];
+  uint32_t format;     /* DB_FORMAT_BLOCKS */
+  uint32_t block_size; /* POSTING_BLOCK */
+} db_header;
+
+// The posting list of an entry in a DB_FORMAT_BLOCKS database. Values are split
+// into blocks of POSTING_BLOCK and stored as variable-byte gaps from the
+// previous value. The first value and data offset of every block after the
+// first are kept in a skip table, so a block can be found and decoded without
+// touching the others.
+typedef struct block_postings {
+  uint32_t len;     /* number of values */
+  uint32_t skips[]; /* per block after the first: its first value, its offset */
+} block_postings;
+#define BLOCK_COUNT(bp) (((bp)->len + POSTING_BLOCK - 1) / POSTING_BLOCK)
+#define BLOCK_SKIPS(bp) (BLOCK_COUNT(bp) > 1 ? BLOCK_COUNT(bp) - 1 : 0)
+#define BLOCK_DATA(bp) ((const unsigned char *) ((bp)->skips + 2 * BLOCK_SKIPS(bp)))
+
 typedef struct database {
   char *m_ptr;         /* ptr to start of db in memory (in binary postings format) */ 
   size_t db_size;      /* size of db in bytes */
   hash_table *h_table; /* hash table used to efficiently search the database */
+  int format;          /* DB_FORMAT_RAW or DB_FORMAT_BLOCKS */
+  char *map_ptr;       /* start of the mapping, including any file header */
+  size_t map_size;
+  struct db_index *index; /* prebuilt index used instead of h_table, or NULL */
+  struct mph *mph;     /* minimal perfect hash used instead of h_table, or NULL */
+  size_t base;         /* offset of m_ptr in the database file */
+  struct prerendered *rendered; /* response lines of the entries, or NULL */
 } database;
 
+// The key ranges owned by the nodes, in strcmp order. Node 0 owns the keys
+// below bounds[0], node i the keys from bounds[i-1] up to bounds[i], and node
+// nbounds every key from bounds[nbounds-1] on. Nodes after it own no keys.
+typedef struct routing_table {
+  int nbounds;
+  char **bounds;
+} routing_table;
+
+// How the parent splits the database between the nodes. Node i's partition
+// runs from starts[i] to starts[i+1].
+typedef struct partition_plan {
+  int total_nodes;
+  char **starts;
+  routing_table routes;
+} partition_plan;
+
 /* -------------------- Parent Process Helper Functions --------------------- */
 
 database *load_database(char *db_filename);
-char *get_partition(database *db, int total_nodes, int node_id, size_t *length);
+partition_plan *plan_partitions(database *db, int total_nodes);
+char *get_partition(partition_plan *plan, int node_id, size_t *length);
 
 /* ------------------ Hash Table Related Helper Functions ------------------- */
 
 void build_hash_table(database *db);
 
+uint64_t hash_key(const char *key, size_t len);
+
 int lookup_insert(hash_table *ht, char *word);
 int lookup_find(hash_table *ht, char *word);
 
@@ -53,24 +138,25 @@ char *find_entry(database *db, char *key);
 
 int port_number_to_str(int port, char *buff);
 void request_line_to_key(char *request_line);
-int entry_to_str(char *entry_offset, char *buffer, int len);
-int value_array_to_str(value_array *va, char *buffer, int len);
+size_t values_str_len(const unsigned int *arr, int n);
+int values_to_str(const unsigned int *arr, int n, char *buffer);
 
 /* ----------------- Value Array Handling Helper Functions ------------------ */
 
 value_array *get_intersection(value_array *va_1, value_array *va_2);
 value_array *get_value_array(char *entry_offset);
-value_array *create_value_array(char *entry_str);
+char *value_array_pack(value_array *va, uint32_t *len);
+value_array *value_array_unpack(const char *buf, uint32_t len);
 
 /* --------------------- Miscellanious Helper Functions --------------------- */
 
 char *get_next_key_offset(char *entry_offset);
+char *next_entry(database *db, char *entry_offset);
+block_postings *get_block_postings(char *entry_offset);
+value_array *get_entry_values(database *db, char *entry_offset, int *owned);
 
-int find_node(char *key, int total_nodes);
+int find_node(routing_table *routes, char *key);
 
 size_t round_up(size_t n, size_t mult);
 
-/* Custom functions */
-int is_found(char* key, char* result);
-char* generate_not_found(char* key);
-char* generate_two_not_found(char* key1, char* key2);
\ No newline at end of file
+#endif /* __UTILS_H__ */